@@ -79,21 +79,11 @@ int main(int argc, char** argv) {
         cv::KeyPointsFilter::retainBest(kps, 1000);
         des->compute(img, kps, dscs);
 
-        // Matching the descriptors
-        std::vector<std::vector<cv::DMatch> > matches_feats;
-
-        // Searching the query descriptors against the features
-        index.searchDescriptors(dscs, &matches_feats, 2, 64);
-
-        // Filtering matches according to the ratio test
+        // Searching the query descriptors against the features, keeping
+        // the matches that pass the ratio test
         std::vector<cv::DMatch> matches;
-        for(unsigned m = 0; m < matches_feats.size(); m++){
-            
-            if(matches_feats[m][0].distance < matches_feats[m][1].distance * 0.8){
-                matches.push_back(matches_feats[m][0]);
-            }
-
-        }
+        index.searchDescriptorsRatio(dscs, &matches, 0.8,
+                                     std::numeric_limits<double>::max(), 64);
 
         std::vector<obindex2::ImageMatch> image_matches;
 
@@ -151,5 +141,9 @@ int main(int argc, char** argv) {
 
     std::cout << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
 
+#ifdef OBINDEX2_PROFILING
+    obindex2::Profiler::instance().printSummary(std::cout);
+#endif
+
     return 0;  // Correct test
 }
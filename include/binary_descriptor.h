@@ -1,6 +1,8 @@
 #pragma once
 
 #include <bitset>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <sstream>
@@ -12,12 +14,60 @@
 
 namespace obindex2 {
 
+// Hamming distance between two descriptors of NBytes bytes. The width is a
+// compile-time constant, so the loops are fully unrolled into 64-bit
+// popcounts plus a byte tail for widths such as AKAZE's 61 bytes.
+template<unsigned NBytes>
+inline int hammingFixed(const unsigned char* a, const unsigned char* b){
+    
+    int dist = 0;
+    
+    for(unsigned i = 0; i + 8 <= NBytes; i += 8){
+        uint64_t x, y;
+        memcpy(&x, a + i, sizeof(uint64_t));
+        memcpy(&y, b + i, sizeof(uint64_t));
+        dist += __builtin_popcountll(x ^ y);
+    }
+
+    for(unsigned i = NBytes & ~7u; i < NBytes; i++){
+        dist += __builtin_popcount(a[i] ^ b[i]);
+    }
+
+    return dist;
+}
+
+// Dispatches to the kernel specialized for the descriptor width:
+// 32 bytes (ORB, BRIEF), 61 bytes (AKAZE) and 64 bytes (BRISK, FREAK).
+inline int hamming(const unsigned char* a, const unsigned char* b,
+                   const unsigned nbytes){
+    switch(nbytes){
+        case 32:
+            return hammingFixed<32>(a, b);
+        case 61:
+            return hammingFixed<61>(a, b);
+        case 64:
+            return hammingFixed<64>(a, b);
+        default:
+            return cv::hal::normHamming(a, b, nbytes);
+    }
+}
+
+// Hamming distances are integers in [0, bits], stored in 16 bits through the
+// search, so descriptors are at most 8191 bytes wide
+typedef uint16_t HammingDist;
+
 class BinaryDescriptor {
 public:
 
     // Constructors
     explicit BinaryDescriptor(const unsigned nbits = 256);                 // 初始化数据为0
     explicit BinaryDescriptor(const unsigned char* bits, unsigned nbytes); // 从bits拷贝数据
+    
+    // Wraps the bits without copying them if copy is false. The bits must
+    // outlive the descriptor, which is meant for queries.
+    explicit BinaryDescriptor(const unsigned char* bits,
+                              unsigned nbytes,
+                              const bool copy);
     explicit BinaryDescriptor(const cv::Mat& desc);                        // 从cv::Mat拷贝数据
     explicit BinaryDescriptor(const BinaryDescriptor& bd);                 // 拷贝构造函数
     
@@ -54,31 +104,27 @@ public:
     }
 
     // 计算汉明距离
-    inline static double distHamming(const BinaryDescriptor& a,
-                                     const BinaryDescriptor& b)
+    inline static HammingDist distHamming(const BinaryDescriptor& a,
+                                          const BinaryDescriptor& b)
     {
-        int hamming = cv::hal::normHamming(a.bits_, b.bits_, a.size_in_bytes_);
-        return static_cast<double>(hamming);
+        return static_cast<HammingDist>(hamming(a.bits_, b.bits_,
+                                                a.size_in_bytes_));
     }
 
     // Operator overloading
     inline bool operator==(const BinaryDescriptor& d) {
-        int hamming = cv::hal::normHamming(bits_, d.bits_, size_in_bytes_);
-        
-        return hamming == 0;
+        return hamming(bits_, d.bits_, size_in_bytes_) == 0;
     }
 
     inline bool operator!=(const BinaryDescriptor& d) {
-        int hamming = cv::hal::normHamming(bits_, d.bits_, size_in_bytes_);
-        
-        return hamming != 0;
+        return hamming(bits_, d.bits_, size_in_bytes_) != 0;
     }
 
     // 复制构造函数
     inline BinaryDescriptor& operator=(const BinaryDescriptor& other) {
         
         // Clearing previous memory
-        if (bits_ != nullptr) {
+        if (bits_ != nullptr && owns_bits_) {
             delete [] bits_;
         }
 
@@ -87,6 +133,7 @@ public:
         size_in_bytes_ = other.size_in_bytes_;
         
         bits_ = new unsigned char[size_in_bytes_];
+        owns_bits_ = true;
         
         memcpy(bits_, other.bits_, sizeof(unsigned char) * size_in_bytes_);
 
@@ -123,6 +170,39 @@ public:
     unsigned char* bits_;
     unsigned size_in_bytes_;
     unsigned size_in_bits_;
+    bool owns_bits_;
+};
+
+// Non-owning view of a batch of descriptors stored row by row, such as the
+// rows of a cv::Mat or a raw buffer
+struct DescriptorView{
+    DescriptorView(const unsigned char* d,
+                   const unsigned r,
+                   const unsigned c,
+                   const size_t s) :
+        data(d),
+        rows(r),
+        cols(c),
+        stride(s)
+    {}
+
+    explicit DescriptorView(const cv::Mat& m) :
+        data(m.data),
+        rows(m.rows),
+        cols(m.cols),
+        stride(m.step)
+    {
+        assert(m.empty() || m.type() == CV_8U);
+    }
+
+    inline const unsigned char* row(const unsigned i) const {
+        return data + i * stride;
+    }
+
+    const unsigned char* data;
+    unsigned rows;
+    unsigned cols;
+    size_t stride;
 };
 
 typedef std::shared_ptr<BinaryDescriptor> BinaryDescriptorPtr;          // 智能指针包装
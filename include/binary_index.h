@@ -1,11 +1,16 @@
 #pragma once
 
+#include <deque>
+#include <limits>
 #include <list>
 #include <mutex>
+#include <set>
 #include <unordered_map>
 #include <vector>
 
 #include "binary_tree.h"
+#include "index_log.h"
+#include "profiler.h"
 
 namespace obindex2{
 
@@ -15,16 +20,22 @@ enum MergePolicy{
     MERGE_POLICY_OR
 };
 
+// Default early-termination slack of the descriptor search
+const double kDefaultSearchEpsilon = 0.25;
+
+// Points checked when looking for a duplicate of a merged word
+const unsigned kMergeChecks = 64;
+
 struct InvIndexItem{
     InvIndexItem() :
         image_id(0),
         pt(0.0f, 0.0f),
-        dist(DBL_MAX),
+        dist(std::numeric_limits<HammingDist>::max()),
         kp_ind(-1){}
 
     InvIndexItem(const int id,
                  const cv::Point2f& kp,
-                 const double d,
+                 const HammingDist d,
                  const int kp_i = -1) :
     image_id(id),
     pt(kp),
@@ -34,7 +45,7 @@ struct InvIndexItem{
 
     unsigned image_id;
     cv::Point2f pt;
-    double dist;
+    HammingDist dist;
     int kp_ind;
 };
 
@@ -60,7 +71,90 @@ struct PointMatches{
     std::vector<cv::Point2f> train;
 };
 
+// Reusable sparse accumulator of image scores. Only the images touched by
+// a query are visited when collecting and resetting the scores.
+struct ScoreBuffer{
+    ScoreBuffer() :
+        base(0),
+        stamp(0)
+    {}
+
+    unsigned base;                      // Image whose score is scores[0]
+    std::vector<double> scores;         // Score of each image from base
+    std::vector<unsigned> touched;      // Images with some posting matched
+    std::vector<unsigned> seen;         // Stamp of the last word counting each image
+    unsigned stamp;
+    std::unordered_map<int, int> nwi;   // Occurrences of each word in the query
+};
+
+// Writes the scores accumulated in buf as one entry per image from buf->base
+// to nimages, skipping the removed ones, and resets buf. When sorting,
+// scored images come first by decreasing score, then the rest by id, so the
+// order does not depend on the sort implementation.
+void collectImageScores(const unsigned nimages,
+                        ScoreBuffer* buf,
+                        std::vector<ImageMatch>* img_matches,
+                        const bool sort,
+                        const std::set<unsigned>* removed = nullptr);
+
+// Words created by one image, examined together once the image is old
+// enough to tell whether they were seen again
+struct PurgeBucket{
+    explicit PurgeBucket(const unsigned id) :
+        image_id(id)
+    {}
+
+    unsigned image_id;
+    std::vector<BinaryDescriptorPtr> words;
+};
+
+// Estimated memory used by each component of the index, in bytes
+struct MemoryUsage{
+    MemoryUsage() :
+        descriptors(0),
+        trees(0),
+        inv_index(0),
+        id_maps(0),
+        direct_index(0)
+    {}
+
+    inline size_t total() const {
+        return descriptors + trees + inv_index + id_maps + direct_index;
+    }
+
+    size_t descriptors;     // Visual words and the descriptor set
+    size_t trees;           // Nodes and leaf references of all trees
+    size_t inv_index;       // Postings of the inverted index
+    size_t id_maps;         // Id <-> descriptor maps and LRU bookkeeping
+    size_t direct_index;    // Keypoints kept per image for matchImages
+};
+
+// Keypoints of one image in the direct index, grouped by the node of tree 0
+// they descend to
+struct DirectIndexEntry{
+    DirectIndexEntry() :
+        version(0)
+    {}
+
+    std::vector<unsigned char> descs;   // Row i at i * descriptor width
+    std::vector<cv::Point2f> pts;
+
+    // Keypoints under each node, valid while tree 0 has this version
+    uint64_t version;
+    std::unordered_map<const BinaryTreeNode*, std::vector<int> > nodes;
+};
+
+class FrozenIndex;
+typedef std::shared_ptr<FrozenIndex> FrozenIndexPtr;
+
 class ImageIndex{
+
+    // Shards score images against the number of images of the whole index
+    friend class ShardServer;
+
+    // Frozen copies are laid out from the words, postings and trees
+    friend class FrozenIndex;
+
 public:
 
     // Constructors
@@ -93,27 +187,258 @@ public:
                       std::vector<ImageMatch>* img_matches,
                       bool sort = true);
 
+    // Scores many query frames at once, in parallel, with the same results as
+    // calling searchImages for each frame
+    void searchImagesBatch(const std::vector<cv::Mat>& descs,
+                           const std::vector<std::vector<cv::DMatch> >& gmatches,
+                           std::vector<std::vector<ImageMatch> >* img_matches,
+                           bool sort = true);
+
     void searchDescriptors(const cv::Mat& descs,
                            std::vector<std::vector<cv::DMatch> >* matches,
                            const unsigned knn = 2,
                            const unsigned checks = 32);
 
+    // Searches the rows of a non-owning view without copying them, e.g. a
+    // raw uint8_t* batch
+    void searchDescriptors(const DescriptorView& descs,
+                           std::vector<std::vector<cv::DMatch> >* matches,
+                           const unsigned knn = 2,
+                           const unsigned checks = 32);
+
+    // Warm-started search for temporally coherent queries. hints[i] is the id
+    // of a word expected close to row i, e.g. the word its track matched in
+    // the previous frame, or -1. Hinted rows start from the leaves holding
+    // that word instead of descending from the root the trees where the
+    // descent would reach it; the other trees are descended as usual.
+    void searchDescriptors(const cv::Mat& descs,
+                           const std::vector<int>& hints,
+                           std::vector<std::vector<cv::DMatch> >* matches,
+                           const unsigned knn = 2,
+                           const unsigned checks = 32);
+
+    void searchDescriptors(const DescriptorView& descs,
+                           const std::vector<int>& hints,
+                           std::vector<std::vector<cv::DMatch> >* matches,
+                           const unsigned knn = 2,
+                           const unsigned checks = 32);
+
+    // Fused search and ratio test, for callers that keep the closest word of
+    // a row only if it is within max_dist and below ratio times the second
+    // closest. Only the two closest words of each row are tracked, and a row
+    // that fails the test stops searching early. The accepted rows are
+    // written to matches, one cv::DMatch each in row order, reusing its
+    // storage. Returns the number of rejected rows.
+    unsigned searchDescriptorsRatio(const cv::Mat& descs,
+                                    std::vector<cv::DMatch>* matches,
+                                    const double ratio = 0.8,
+                                    const double max_dist =
+                                            std::numeric_limits<double>::max(),
+                                    const unsigned checks = 32);
+
+    unsigned searchDescriptorsRatio(const DescriptorView& descs,
+                                    std::vector<cv::DMatch>* matches,
+                                    const double ratio = 0.8,
+                                    const double max_dist =
+                                            std::numeric_limits<double>::max(),
+                                    const unsigned checks = 32);
+
+    // Warm-started by hints, as the hinted searchDescriptors
+    unsigned searchDescriptorsRatio(const DescriptorView& descs,
+                                    const std::vector<int>& hints,
+                                    std::vector<cv::DMatch>* matches,
+                                    const double ratio = 0.8,
+                                    const double max_dist =
+                                            std::numeric_limits<double>::max(),
+                                    const unsigned checks = 32);
+
+    // Searches within a time budget of budget_us microseconds, e.g. a slice
+    // of the frame on a tracking thread. Every row first descends all the
+    // trees, even past the budget. The time left goes to backtracking, one
+    // node at a time, the rows with the most ambiguous two closest words
+    // first, each up to checks points. truncated gets the rows still
+    // searching at the deadline, in order. Their matches are the best found
+    // so far.
+    void searchDescriptorsDeadline(const cv::Mat& descs,
+                                   std::vector<std::vector<cv::DMatch> >* matches,
+                                   const unsigned budget_us,
+                                   std::vector<unsigned>* truncated,
+                                   const unsigned knn = 2,
+                                   const unsigned checks = 32);
+
+    void searchDescriptorsDeadline(const DescriptorView& descs,
+                                   std::vector<std::vector<cv::DMatch> >* matches,
+                                   const unsigned budget_us,
+                                   std::vector<unsigned>* truncated,
+                                   const unsigned knn = 2,
+                                   const unsigned checks = 32);
+
+    // Searches the descriptors of many frames in one pass, e.g. the cameras
+    // of a rig: their rows are searched as a single block, so small frames
+    // fill the interleaved search and, with query reordering, rows of all
+    // the frames landing in the same cluster walk its nodes together.
+    // matches[f] holds the result for frame f, as searchDescriptors on it.
+    void searchDescriptorsBatch(
+                        const std::vector<cv::Mat>& descs,
+                        std::vector<std::vector<std::vector<cv::DMatch> > >* matches,
+                        const unsigned knn = 2,
+                        const unsigned checks = 32);
+
     void deleteDescriptor(const unsigned desc_id);
 
     void getMatchings(const std::vector<cv::KeyPoint>& query_kps,
                       const std::vector<cv::DMatch>& matches,
                       std::unordered_map<unsigned, PointMatches>* point_matches);
 
+    // Keeps the descriptors of the images added from now on, grouped by the
+    // node of tree 0 they reach after descending level levels, so that two
+    // images can be matched with matchImages
+    void enableDirectIndex(const unsigned level = 2);
+
+    // Matches the keypoints of two images of the direct index, comparing only
+    // keypoints under the same node. A keypoint of image_a is matched to the
+    // closest keypoint of image_b in its node if the distance is at most
+    // max_dist and below ratio times the second closest. queryIdx refers to
+    // the keypoints of image_a and trainIdx to those of image_b.
+    // Returns false if any of the images is not in the direct index.
+    bool matchImages(const unsigned image_a,
+                     const unsigned image_b,
+                     std::vector<cv::DMatch>* matches,
+                     const double ratio = 0.8,
+                     const double max_dist = 64.0);
+
+    // Same, returning the coordinates of the matched keypoints
+    bool matchImages(const unsigned image_a,
+                     const unsigned image_b,
+                     PointMatches* point_matches,
+                     const double ratio = 0.8,
+                     const double max_dist = 64.0);
+
+    // Images added so far, removed ones included. It is also the id expected
+    // for the next image.
     inline unsigned numImages(){
         return nimages_;
     }
 
+    // Images added and not removed
+    inline unsigned numActiveImages() const {
+        return nimages_ - first_image_ - removed_images_.size();
+    }
+
+    // Strips the postings of the image and deletes the words left without
+    // postings from all the trees at once. Later searches score only the
+    // remaining images. Returns false if the image is not in the index.
+    bool removeImage(const unsigned image_id);
+
+    // Keeps only the last window images: after each addImage, the oldest
+    // images are removed. 0 keeps every image.
+    void setImageWindow(const unsigned window);
+
     inline unsigned numDescriptors(){
         return dset_.size();
     }
 
+    // Nodes of all the trees, and how many of them are degraded, i.e. were
+    // left with fewer than half of their children by deletions. Many
+    // degraded nodes call for a rebuild.
+    unsigned numNodes() const;
+    unsigned numDegradedNodes() const;
+
+    // Width in bytes of the indexed descriptors, fixed by the first image
+    inline unsigned descriptorBytes() const {
+        return desc_bytes_;
+    }
+
+    // Early termination of searchDescriptors: the search stops once the
+    // closest pending node is farther than (1 + epsilon) times the distance to
+    // the k-th neighbour found so far. Larger values check more points, up to
+    // the checks given to the search.
+    void setSearchEpsilon(const double epsilon);
+
+    // Insertion filter of addImage with matches: an unmatched descriptor
+    // within radius bits of a word of the leaf it would land in, in any of
+    // the trees, is added as a match of the closest such word instead of as a
+    // new word. 0 disables the filter.
+    void setInsertRadius(const unsigned radius);
+
+    // Locality of the batched searches, searchDescriptors and
+    // searchDescriptorsRatio: the rows are grouped by the child of the root
+    // of tree 0 they are closest to before being searched, so rows walking
+    // the same subtrees run back to back on one thread. The results keep the
+    // order of the rows. Off by default.
+    void setQueryReordering(const bool reorder);
+
+    // Sampled construction of the trees, for large indexes: with more than
+    // sample words, the upper levels of each tree are split on a random
+    // sample of this size, and the subtrees below them are built from all
+    // their words in parallel, one tree after another. 0, the default,
+    // builds each tree from all the words, one tree per thread.
+    void setBuildSample(const unsigned sample);
+
+    // Limits the size of the index. When the budget is exceeded, the least
+    // recently matched words are evicted, at most max_evictions per image.
+    // @param max_bytes: memory budget, 0 means unlimited
+    // @param max_words: word budget, 0 means unlimited
+    // @param max_evictions: words evicted per call to addImage
+    void setMemoryBudget(const size_t max_bytes,
+                         const unsigned max_words = 0,
+                         const unsigned max_evictions = 100);
+
+    MemoryUsage memoryUsage() const;
+
+    // Read-only compacted copy of the index, answering the same queries
+    FrozenIndexPtr freeze() const;
+
+    // Imports the words and postings of another index, e.g. the map of
+    // another session, and rebuilds the trees once. Its images get the ids
+    // image_id_offset + id, so the offset must be at least numImages().
+    // If dedup_radius is not 0, an imported word within this distance of a
+    // word of this index adds its postings to that word instead, which is
+    // updated as by a match under the merge policy. The merge is not
+    // written to the log: with a log attached, the merged index is
+    // checkpointed to the snapshot the log was last checkpointed to or
+    // recovered from. Returns false if the log could not be committed, and
+    // nothing was merged, or if the checkpoint failed.
+    bool merge(const ImageIndex& other,
+               const unsigned image_id_offset,
+               const unsigned dedup_radius = 0);
+
+    // Snapshots. The trees are not stored, they are rebuilt when loading.
+    bool save(const std::string& filename) const;
+    bool load(const std::string& filename);
+
+    // Starts logging every update to a new write-ahead log, replacing any
+    // log at log_path. The index is first checkpointed to snapshot_path, so
+    // recover(snapshot_path, log_path) finds the images added before the
+    // log. Returns false, without a log, if the checkpoint failed.
+    bool enableLog(const std::string& log_path,
+                   const std::string& snapshot_path,
+                   const unsigned group_records = 32);
+
+    // Commits the pending records of the log
+    bool syncLog();
+
+    // Folds the log into a snapshot and empties the log. merge checkpoints
+    // to the same snapshot
+    bool checkpoint(const std::string& snapshot_path);
+
+    // Loads the snapshot, if any, replays the log records written after it
+    // and keeps logging to the same log
+    bool recover(const std::string& snapshot_path,
+                 const std::string& log_path,
+                 const unsigned group_records = 32);
+
     inline void rebuild(){
+        OBINDEX2_PROFILE_SCOPE(PROFILE_REBUILD);
+
         if(init_){
+
+            // Freeing the old trees is as long as building them, one tree
+            // per thread as well
+            #pragma omp parallel for
+            for(unsigned i = 0; i < trees_.size(); i++){
+                trees_[i].reset();
+            }
             trees_.clear();
             initTrees();
         }
@@ -131,9 +456,18 @@ private:
     unsigned init_;             // 是否初始化
     unsigned nimages_;          // 图像数目
     unsigned ndesc_;            // 描述子数目
+    unsigned desc_bytes_;       // 描述子字节数, 由第一幅图像确定
     MergePolicy merge_policy_;  // 融合策略
     bool purge_descriptors_;    // 删除不稳定描述子
     unsigned min_feat_apps_;    // 
+    size_t max_bytes_;          // 内存预算, 0为不限制
+    unsigned max_words_;        // 描述子数目预算, 0为不限制
+    unsigned max_evictions_;    // 每幅图像最多淘汰的描述子数目
+    size_t nposts_;             // inv_index_中的条目总数
+    double search_epsilon_;     // 提前终止搜索的阈值
+    unsigned insert_radius_;    // 插入时视为重复描述子的汉明半径, 0为不检查
+    bool reorder_queries_;      // 批量搜索前按树0的第一层聚类重排查询
+    unsigned build_sample_;     // 构建树的上层时的采样数目, 0为不采样
 
     // t颗树
     std::vector<BinaryTreePtr> trees_;
@@ -147,24 +481,112 @@ private:
     // 描述子的索引
     std::unordered_map<unsigned, BinaryDescriptorPtr> id_to_desc_;
     
-    // 最近添加的描述子
-    std::list<BinaryDescriptorPtr> recently_added_;
+    // 最近添加的描述子, 按添加时的图像分桶, 桶过期时做进一步的筛选
+    std::deque<PurgeBucket> purge_buckets_;
+
+    // 预写日志
+    std::shared_ptr<IndexLog> log_;
+    bool replaying_;            // 正在重放日志
+    std::string snapshot_path_; // 与日志对应的快照, 恢复时与日志一同读取
+
+    // 按最近匹配时间排序的描述子, 最久未匹配的在前
+    std::list<BinaryDescriptorPtr> lru_;
+    std::unordered_map<BinaryDescriptorPtr,
+                       std::list<BinaryDescriptorPtr>::iterator> lru_pos_;
+
+    // 已删除的图像: first_image_之前的全部, 以及removed_images_中的
+    unsigned first_image_;
+    std::set<unsigned> removed_images_;
+    unsigned image_window_;     // 保留的最近图像数目, 0为不限制
+
+    // 每幅图像的倒排条目所在的描述子id, 用于删除图像
+    std::unordered_map<unsigned, std::vector<unsigned> > image_words_;
+
+    // 正向索引: 每幅图像的特征点, 按树0中的节点分组
+    bool direct_index_enabled_;
+    unsigned direct_level_;     // 分组节点所在的层
+    std::unordered_map<unsigned, DirectIndexEntry> direct_index_;
 
     void initTrees();
+
+    // 所有描述子的宽度必须一致, 距离计算根据宽度选择对应的实现
+    void checkDescriptorWidth(const unsigned cols);
     
     // 返回最近的knn个描述子, 和它们的距离
-    void searchDescriptor(BinaryDescriptorPtr q,
+    void searchDescriptor(const BinaryDescriptor& q,
                           std::vector<BinaryDescriptorPtr>* neigh,
-                          std::vector<double>* distances,
+                          std::vector<HammingDist>* distances,
                           unsigned knn = 2,
-                          unsigned checks = 32);
-
-    void insertDescriptor(BinaryDescriptorPtr q);
+                          unsigned checks = 32,
+                          BinaryDescriptorPtr hint = nullptr);
+
+    // 在buf中累加每幅图像的TF-IDF得分, total_images为IDF中使用的图像总数
+    void scoreImages(const unsigned nqueries,
+                     const std::vector<cv::DMatch>& gmatches,
+                     const unsigned total_images,
+                     ScoreBuffer* buf) const;
+
+    // 按描述子id查找提示描述子, 已删除的为nullptr
+    void hintWords(const std::vector<int>& hints,
+                   std::vector<BinaryDescriptorPtr>* words) const;
+
+    // 按树0根节点最近的子节点对查询稳定排序: order[i]为第i个查询的原始行,
+    // rows为按此顺序连续存放的查询
+    void reorderQueries(const DescriptorView& descs,
+                        std::vector<unsigned>* order,
+                        std::vector<unsigned char>* rows) const;
+
+    // 按order重排每行的提示描述子
+    void permuteHints(const std::vector<unsigned>& order,
+                      std::vector<BinaryDescriptorPtr>* words) const;
+
+    // 将搜索结果转换为cv::DMatch
+    void translateMatches(const unsigned query_idx,
+                          const std::vector<BinaryDescriptorPtr>& neighs,
+                          const std::vector<HammingDist>& dists,
+                          std::vector<cv::DMatch>* des_match) const;
+
+    // 将这些描述子插入所有树中, 每棵树用所有线程按叶子并行插入
+    void insertDescriptors(const std::vector<BinaryDescriptorPtr>& descs);
 
     void deleteDescriptor(BinaryDescriptorPtr q);
 
+    // 在一个并行区域内从所有树中删除这些描述子. 重放其他记录时会再次
+    // 删除的描述子 (logged为假) 不写入日志
+    void deleteDescriptors(const std::vector<BinaryDescriptorPtr>& descs,
+                           const bool logged = true);
+
     void purgeDescriptors(const unsigned curr_img);
 
+    // 未匹配的描述子在其将插入的叶子中有insert_radius_内的描述子时, 作为
+    // 该描述子的匹配加入matches. 返回新增的匹配数目
+    unsigned matchNearDuplicates(const cv::Mat& descs,
+                                 std::vector<cv::DMatch>* matches) const;
+
+    bool saveSnapshot(const std::string& filename, const uint64_t lsn) const;
+    bool loadSnapshot(const std::string& filename, uint64_t* lsn);
+
+    // 将快照读入这个新建的索引, 不构建树
+    bool readSnapshot(const std::string& filename, uint64_t* lsn);
+    void applyLogRecord(const LogRecord& record);
+
+    // 将描述子移到LRU列表的末尾
+    void touchDescriptor(BinaryDescriptorPtr q);
+
+    // 超出预算时淘汰最久未匹配的描述子
+    void evictDescriptors();
+
+    // 删除超出窗口的最旧图像
+    void retireImages();
+
+    // 将图像的特征点加入正向索引
+    void addToDirectIndex(const unsigned image_id,
+                          const std::vector<cv::KeyPoint>& kps,
+                          const cv::Mat& descs);
+
+    // 树0的结构改变后, 重新计算特征点所在的节点
+    void groupDirectEntry(DirectIndexEntry* entry) const;
+
 };
 
 }  // namespace obindex2
@@ -1,9 +1,10 @@
 #pragma once
 
-#include <stdlib.h>
-#include <time.h>
-
+#include <cstdint>
 #include <limits>
+#include <mutex>
+#include <random>
+#include <unordered_map>
 #include <unordered_set>
 
 #include "binary_descriptor.h"
@@ -11,6 +12,123 @@
 
 namespace obindex2 {
 
+// Finds the child center closest to q. centers holds k slots of nbytes, the
+// first count in use. dists receives the distance to each slot in use and
+// the index of the closest one is returned.
+typedef int (*NearestChildFn)(const unsigned char* q,
+                              const unsigned char* centers,
+                              const unsigned count,
+                              const unsigned k,
+                              const unsigned nbytes,
+                              int* dists);
+
+// Kernel for a fixed branching factor and width. All K slots are compared
+// and unused ones masked, so the distances and the min-reduction have no
+// data-dependent trip count and can be unrolled and vectorized.
+template<unsigned K, unsigned NBytes>
+int nearestChildFixed(const unsigned char* q,
+                      const unsigned char* centers,
+                      const unsigned count,
+                      const unsigned k,
+                      const unsigned nbytes,
+                      int* dists){
+
+    for(unsigned i = 0; i < K; i++){
+        int dist = hammingFixed<NBytes>(q, centers + i * NBytes);
+        dists[i] = i < count ? dist : std::numeric_limits<int>::max();
+    }
+
+    int best = 0;
+    for(unsigned i = 1; i < K; i++){
+        best = dists[i] < dists[best] ? i : best;
+    }
+
+    return best;
+}
+
+// Kernel for any branching factor and width
+int nearestChild(const unsigned char* q,
+                 const unsigned char* centers,
+                 const unsigned count,
+                 const unsigned k,
+                 const unsigned nbytes,
+                 int* dists);
+
+// Picks the kernel for the branching factor and the width of the descriptors
+NearestChildFn selectNearestChild(const unsigned k, const unsigned nbytes);
+
+// Leaf of each descriptor of a tree, split in shards with their own lock, so
+// that threads filling different leaves rarely wait for each other
+class LeafMap{
+public:
+
+    // The leaf holding d, or nullptr
+    inline BinaryTreeNodePtr find(const BinaryDescriptorPtr& d) const {
+        const Shard& shard = shardOf(d);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.map.find(d);
+        return it != shard.map.end() ? it->second : nullptr;
+    }
+
+    inline void set(const BinaryDescriptorPtr& d, const BinaryTreeNodePtr& leaf){
+        Shard& shard = shardOf(d);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.map[d] = leaf;
+    }
+
+    inline void erase(const BinaryDescriptorPtr& d){
+        Shard& shard = shardOf(d);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.map.erase(d);
+    }
+
+    // Not thread-safe, as clear
+    inline void reserve(const size_t n){
+        for(unsigned i = 0; i < kShards; i++){
+            shards_[i].map.reserve(n / kShards + 1);
+        }
+    }
+
+    inline void clear(){
+        for(unsigned i = 0; i < kShards; i++){
+            shards_[i].map.clear();
+        }
+    }
+
+    inline size_t size() const {
+        size_t n = 0;
+        for(unsigned i = 0; i < kShards; i++){
+            n += shards_[i].map.size();
+        }
+        return n;
+    }
+
+private:
+
+    static const unsigned kShards = 64;
+
+    struct Shard{
+        mutable std::mutex mutex;
+        std::unordered_map<BinaryDescriptorPtr, BinaryTreeNodePtr> map;
+    };
+
+    Shard shards_[kShards];
+
+    // Descriptors are at least 16-byte aligned, the low bits are dropped
+    inline static unsigned shardIndex(const BinaryDescriptorPtr& d){
+        uintptr_t p = reinterpret_cast<uintptr_t>(d.get());
+        return ((p >> 4) ^ (p >> 10)) % kShards;
+    }
+
+    inline Shard& shardOf(const BinaryDescriptorPtr& d){
+        return shards_[shardIndex(d)];
+    }
+
+    inline const Shard& shardOf(const BinaryDescriptorPtr& d) const {
+        return shards_[shardIndex(d)];
+    }
+};
+
 class BinaryTree {
 public:
 
@@ -20,10 +138,17 @@ public:
     // @param tree_id
     // @param k
     // @param s
+    // @param sample: if there are more descriptors, the upper levels are
+    // split on a random sample of this size and the subtrees below are
+    // built from all their descriptors, in parallel. 0 never samples
+    // @param seed: the random centers of the splits are drawn from
+    // seed + tree_id, so each tree of an index gets its own centers
     explicit BinaryTree(BinaryDescriptorSetPtr dset,
                         const unsigned tree_id = 0,
                         const unsigned k = 16,
-                        const unsigned s = 150);
+                        const unsigned s = 150,
+                        const unsigned sample = 0,
+                        const unsigned seed = 0);
     
     virtual ~BinaryTree();
 
@@ -31,31 +156,89 @@ public:
     void buildTree();
     void deleteTree();
 
-    // 从根节点开始生成搜索队列
-    unsigned traverseFromRoot(BinaryDescriptorPtr q,
-                                NodeQueuePtr pq,
-                                DescriptorQueuePtr r);
-
-    // 从某个节点生成搜索队列
-    void traverseFromNode(BinaryDescriptorPtr q,
-                            BinaryTreeNodePtr n,
-                            NodeQueuePtr pq,
-                            DescriptorQueuePtr r);
-                            
-    BinaryTreeNodePtr searchFromRoot(BinaryDescriptorPtr q);
-    BinaryTreeNodePtr searchFromNode(BinaryDescriptorPtr q,
+    // 从根节点开始搜索: 贪心地下降到叶子, 其余子节点加入pq, 叶子中尚未
+    // 检查过的描述子加入r. 返回新检查的描述子数目
+    unsigned traverseFromRoot(const BinaryDescriptor& q,
+                              NodePriorityQueue* pq,
+                              DescriptorQueue* r,
+                              BinaryDescriptorSet* checked);
+
+    // 从某个节点开始搜索, 同上
+    unsigned traverseFromNode(const BinaryDescriptor& q,
+                              BinaryTreeNode* n,
+                              NodePriorityQueue* pq,
+                              DescriptorQueue* r,
+                              BinaryDescriptorSet* checked);
+
+    // 从包含提示描述子的叶子开始搜索: 叶子及其所有祖先的兄弟节点加入pq,
+    // 与从根节点下降时相同. scan为真时直接检查叶子中的描述子, 否则叶子本身
+    // 也加入pq. 如果从父节点不会下降到这个叶子, 提示不可靠, 不做任何改动
+    // 并返回false
+    bool traverseFromLeaf(const BinaryDescriptor& q,
+                          BinaryTreeNodePtr leaf,
+                          const bool scan,
+                          NodePriorityQueue* pq,
+                          DescriptorQueue* r,
+                          BinaryDescriptorSet* checked,
+                          unsigned* nchecked);
+
+    BinaryTreeNodePtr searchFromRoot(const BinaryDescriptor& q);
+    BinaryTreeNodePtr searchFromNode(const BinaryDescriptor& q,
                                     BinaryTreeNodePtr n);
     void addDescriptor(BinaryDescriptorPtr q);
+
+    // Inserts a batch of descriptors using all threads. The descriptors are
+    // grouped by the leaf they descend to, and each leaf is filled or split
+    // by one thread, so inserts landing in different leaves do not wait for
+    // each other. Same tree as inserting them one at a time, up to the
+    // random centers of the splits
+    void addDescriptors(const std::vector<BinaryDescriptorPtr>& descs);
     void deleteDescriptor(BinaryDescriptorPtr q);
     void printTree();
-    inline unsigned numDegradedNodes() {
+    inline unsigned numDegradedNodes() const {
         return degraded_nodes_;
     }
 
-    inline unsigned numNodes() {
+    inline unsigned numNodes() const {
         return nset_.size();
     }
 
+    inline BinaryTreeNodePtr getRoot() const {
+        return root_;
+    }
+
+    // 包含该描述子的叶子, 不存在时返回nullptr
+    inline BinaryTreeNodePtr getLeaf(BinaryDescriptorPtr q) const {
+        return desc_to_node_.find(q);
+    }
+
+    // Index of the child of n closest to q, dists must hold k entries
+    inline int closestChild(const BinaryTreeNode* n,
+                            const unsigned char* q,
+                            int* dists) const {
+        return nearest_(q, n->childCenters(), n->childNodeSize(),
+                        k_, desc_bytes_, dists);
+    }
+
+    inline unsigned branchingFactor() const {
+        return k_;
+    }
+
+    // Node reached by descending level steps from the root, or the leaf
+    // where the descent stops before. dists must hold k entries
+    const BinaryTreeNode* descendToLevel(const unsigned char* q,
+                                         const unsigned level,
+                                         int* dists) const;
+
+    // Changes whenever nodes are created or removed or a center changes, and
+    // is unique among all trees, so descents cached with it can be validated
+    inline uint64_t version() const {
+        return version_;
+    }
+
+    // Estimated memory used by the nodes of the tree, in bytes
+    size_t memoryUsage() const;
+
 private:
 
     BinaryDescriptorSetPtr dset_;
@@ -64,18 +247,51 @@ private:
     unsigned k_;
     unsigned s_;
     unsigned k_2_;
+    unsigned sample_;
+    unsigned desc_bytes_;
+    NearestChildFn nearest_;
     NodeSet nset_;
+    uint64_t version_;
 
     // 描述子与节点之间的索引
-    std::unordered_map<BinaryDescriptorPtr, BinaryTreeNodePtr> desc_to_node_;
+    LeafMap desc_to_node_;
+
+    // 保护nset_, 并发地分裂叶子时只在加入新节点时持有
+    std::mutex nodes_mutex_;
+
+    // 选取中心的随机数. 并行构建的子树和分裂的叶子各自使用由它生成的种子
+    std::mt19937 rng_;
 
     // Tree statistics
     unsigned degraded_nodes_;
-    unsigned nvisited_nodes_;
 
-    void buildNode(BinaryDescriptorSet d, BinaryTreeNodePtr root);
+    void buildNode(std::vector<BinaryDescriptorPtr>* descs,
+                   BinaryTreeNodePtr root,
+                   std::mt19937* rng);
+
+    // 用rng随机选取k个中心, 为root生成子节点, 并将descs分配到各子节点
+    void splitNode(std::vector<BinaryDescriptorPtr>* descs,
+                   BinaryTreeNodePtr root,
+                   std::vector<std::vector<BinaryDescriptorPtr> >* assoc_descs,
+                   std::mt19937* rng);
+
+    // 由采样构建上层节点, 再将所有描述子分配到上层之下的子树并行构建
+    void buildSampled(std::vector<BinaryDescriptorPtr>* descs);
+
+    // 只用采样划分上层节点, 未再划分的节点加入frontier. scale为每个
+    // 采样代表的描述子数目
+    void buildUpperNode(std::vector<BinaryDescriptorPtr>* sample,
+                        BinaryTreeNodePtr root,
+                        const double scale,
+                        std::vector<BinaryTreeNodePtr>* frontier);
+    void setDescriptorBytes(const unsigned nbytes);
+
+    // 节点的shared_ptr, 由父节点 (或根节点) 持有
+    BinaryTreeNodePtr ownerOf(const BinaryTreeNode* n) const;
+    void updateVersion();
+
     void printNode(BinaryTreeNodePtr n);
-    void deleteNodeRecursive(BinaryTreeNodePtr n);
+    void deleteNodeRecursive(BinaryTreeNode* n);
 };
 
 typedef std::shared_ptr<BinaryTree> BinaryTreePtr;
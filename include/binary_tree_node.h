@@ -1,5 +1,6 @@
 #pragma once
 
+#include <random>
 #include <vector>
 #include <unordered_set>
 
@@ -17,7 +18,7 @@ public:
     BinaryTreeNode();
     explicit BinaryTreeNode(const bool leaf,
                             BinaryDescriptorPtr desc = nullptr,
-                            BinaryTreeNodePtr root = nullptr);
+                            BinaryTreeNode* root = nullptr);
 
     // Methods
     inline bool isLeaf() const {
@@ -36,7 +37,7 @@ public:
         is_bad_ = bad;
     }
 
-    inline BinaryDescriptorPtr getDescriptor() const {
+    inline const BinaryDescriptorPtr& getDescriptor() const {
         return desc_;
     }
 
@@ -44,34 +45,52 @@ public:
         desc_ = desc;
     }
 
-    inline BinaryTreeNodePtr getRoot() const {
+    // The parent is not owned, the parent owns its children
+    inline BinaryTreeNode* getRoot() const {
         return root_;
     }
 
-    inline void setRoot(BinaryTreeNodePtr root){
+    inline void setRoot(BinaryTreeNode* root){
         root_ = root;
     }
 
-    inline double distance(BinaryDescriptorPtr desc) const {
-        return obindex2::BinaryDescriptor::distHamming(*desc_, *desc);
+    inline HammingDist distance(const BinaryDescriptor& desc) const {
+        return obindex2::BinaryDescriptor::distHamming(*desc_, desc);
     }
 
-    inline void addChildNode(BinaryTreeNodePtr child){
-        ch_nodes_.insert(child);
-    }
+    // Prepares the slots of the children of an internal node: up to k
+    // children, their centers packed in one zero-padded block
+    void reserveChildren(const unsigned k, const unsigned nbytes);
 
-    inline void deleteChildNode(BinaryTreeNodePtr child){
-        ch_nodes_.erase(child);
-    }
+    void addChildNode(BinaryTreeNodePtr child);
+
+    // Returns the removed child
+    BinaryTreeNodePtr deleteChildNode(const BinaryTreeNode* child);
 
-    inline std::unordered_set<BinaryTreeNodePtr>* getChildrenNodes(){
+    // Copies again the center of a child after it changed
+    void updateChildCenter(const BinaryTreeNode* child);
+
+    inline std::vector<BinaryTreeNodePtr>* getChildrenNodes(){
         return &ch_nodes_;
     }
 
+    inline const BinaryTreeNodePtr& getChildNode(const unsigned i) const {
+        return ch_nodes_[i];
+    }
+
     inline unsigned childNodeSize() const {
         return ch_nodes_.size();
     }
 
+    // Center of child i at i * centerBytes()
+    inline const unsigned char* childCenters() const {
+        return ch_centers_.data();
+    }
+
+    inline unsigned centerBytes() const {
+        return center_bytes_;
+    }
+
     inline void addChildDescriptor(BinaryDescriptorPtr child){
         ch_descs_.insert(child);
     }
@@ -88,8 +107,8 @@ public:
         return ch_descs_.size();
     }
 
-    inline void selectNewCenter(){
-        desc_ = *std::next(ch_descs_.begin(), rand() % ch_descs_.size());
+    inline void selectNewCenter(std::mt19937* rng){
+        desc_ = *std::next(ch_descs_.begin(), (*rng)() % ch_descs_.size());
     }
 
 private:
@@ -97,8 +116,10 @@ private:
     bool is_leaf_;
     bool is_bad_;
     BinaryDescriptorPtr desc_;
-    BinaryTreeNodePtr root_;
-    std::unordered_set<BinaryTreeNodePtr> ch_nodes_;
+    BinaryTreeNode* root_;
+    std::vector<BinaryTreeNodePtr> ch_nodes_;
+    std::vector<unsigned char> ch_centers_;     // 子节点中心, 连续存放
+    unsigned center_bytes_;
     std::unordered_set<BinaryDescriptorPtr> ch_descs_;
 };
 
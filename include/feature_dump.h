@@ -0,0 +1,51 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+namespace obindex2 {
+
+// Keypoints and descriptors of a sequence of images, extracted once and then
+// streamed image by image by the offline tools. The file holds a header and
+// one record per image: its id, the keypoint positions and the descriptor
+// rows, written with ByteWriter.
+class FeatureDumpWriter{
+public:
+    explicit FeatureDumpWriter(const std::string& filename);
+
+    bool write(const unsigned image_id,
+               const std::vector<cv::KeyPoint>& kps,
+               const cv::Mat& descs);
+
+    inline bool good() const {
+        return out_.good();
+    }
+
+private:
+    std::ofstream out_;
+};
+
+class FeatureDumpReader{
+public:
+    explicit FeatureDumpReader(const std::string& filename);
+
+    // Reads the next image. Returns false at the end of the file or after a
+    // truncated record.
+    bool next(unsigned* image_id,
+              std::vector<cv::KeyPoint>* kps,
+              cv::Mat* descs);
+
+    // The file exists and has a valid header
+    inline bool good() const {
+        return valid_;
+    }
+
+private:
+    std::ifstream in_;
+    bool valid_;
+};
+
+}  // namespace obindex2
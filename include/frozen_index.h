@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <set>
+#include <vector>
+
+#include "binary_index.h"
+
+namespace obindex2 {
+
+// Node of a frozen tree. The children of an internal node are stored
+// contiguously from first; a leaf references count entries from first.
+struct FrozenNode{
+    uint32_t first;
+    uint32_t count : 31;
+    uint32_t leaf : 1;
+};
+
+// A tree laid out breadth-first in flat arrays
+struct FrozenTree{
+    std::vector<FrozenNode> nodes;          // Root first, breadth-first order
+    std::vector<unsigned char> centers;     // Center of node i at i * desc_bytes
+    std::vector<uint32_t> leaf_words;       // Word of each leaf entry
+};
+
+// Immutable, compacted copy of an ImageIndex. It answers the same
+// searchDescriptors/searchImages queries without the hash sets, maps and
+// shared pointers of the dynamic index.
+class FrozenIndex{
+public:
+
+    // Constructors
+    explicit FrozenIndex(const ImageIndex& index);
+
+    // Methods
+    void searchImages(const cv::Mat& descs,
+                      const std::vector<cv::DMatch>& gmatches,
+                      std::vector<ImageMatch>* img_matches,
+                      bool sort = true) const;
+
+    void searchDescriptors(const cv::Mat& descs,
+                           std::vector<std::vector<cv::DMatch> >* matches,
+                           const unsigned knn = 2,
+                           const unsigned checks = 32) const;
+
+    void searchDescriptors(const DescriptorView& descs,
+                           std::vector<std::vector<cv::DMatch> >* matches,
+                           const unsigned knn = 2,
+                           const unsigned checks = 32) const;
+
+    // Same as ImageIndex::setSearchEpsilon, initially copied from the index
+    void setSearchEpsilon(const double epsilon);
+
+    inline unsigned numImages() const {
+        return nimages_;
+    }
+
+    inline unsigned numActiveImages() const {
+        return nimages_ - first_image_ - removed_images_.size();
+    }
+
+    inline unsigned numDescriptors() const {
+        return word_ids_.size();
+    }
+
+    MemoryUsage memoryUsage() const;
+
+private:
+
+    unsigned desc_bytes_;
+    unsigned nimages_;
+    unsigned first_image_;                  // Images removed from the index:
+    std::set<unsigned> removed_images_;     // the ones before and these
+    double search_epsilon_;
+
+    // Words sorted by id
+    std::vector<uint32_t> word_ids_;
+
+    // Descriptor of word i at i * desc_bytes, shared by all the trees
+    std::vector<unsigned char> word_descs_;
+
+    // Postings of word i: post_images_[post_offsets_[i], post_offsets_[i + 1])
+    std::vector<uint32_t> post_offsets_;
+    std::vector<uint32_t> post_images_;
+    std::vector<uint32_t> word_nimages_;    // Distinct images of each word
+
+    std::vector<FrozenTree> trees_;
+
+    void freezeTree(const BinaryTreePtr& tree,
+                    const std::unordered_map<BinaryDescriptorPtr, uint32_t>& word_index,
+                    FrozenTree* ftree);
+
+    void searchDescriptor(const unsigned char* q,
+                          std::vector<uint32_t>* neigh,
+                          std::vector<HammingDist>* distances,
+                          const unsigned knn,
+                          const unsigned checks) const;
+
+    // Index of the word with this id, or -1 if it does not exist
+    int wordIndex(const unsigned desc_id) const;
+};
+
+}  // namespace obindex2
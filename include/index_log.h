@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+namespace obindex2 {
+
+enum LogRecordType{
+    LOG_RECORD_ADD_IMAGE = 1,           // addImage without matches
+    LOG_RECORD_ADD_IMAGE_MATCHES,       // addImage with matches, merges included
+    LOG_RECORD_DELETE_DESCRIPTOR,       // Word removed by any path
+    LOG_RECORD_REMOVE_IMAGE             // Image removed, explicitly or by the window
+};
+
+struct LogRecord{
+    LogRecord() :
+        type(0),
+        lsn(0)
+    {}
+
+    unsigned type;
+    uint64_t lsn;           // Log sequence number, increasing from 1
+    std::string payload;
+};
+
+// Append-only write-ahead log of the updates of an ImageIndex. Records are
+// buffered and written with a single fdatasync per group (group commit).
+class IndexLog{
+public:
+
+    // Constructors
+
+    // Opens the log for appending. Anything after valid_bytes, such as a
+    // record torn by a crash, is discarded.
+    // @param path
+    // @param next_lsn: sequence number of the next record
+    // @param valid_bytes: size of the valid prefix of the log
+    // @param group_records: records buffered before a commit
+    // @param group_bytes: bytes buffered before a commit
+    explicit IndexLog(const std::string& path,
+                      const uint64_t next_lsn = 1,
+                      const uint64_t valid_bytes = 0,
+                      const unsigned group_records = 32,
+                      const size_t group_bytes = 1 << 20);
+
+    // Commits the pending records
+    virtual ~IndexLog();
+
+    // Methods
+    void appendAddImage(const unsigned image_id,
+                        const std::vector<cv::KeyPoint>& kps,
+                        const cv::Mat& descs);
+
+    void appendAddImage(const unsigned image_id,
+                        const std::vector<cv::KeyPoint>& kps,
+                        const cv::Mat& descs,
+                        const std::vector<cv::DMatch>& matches);
+
+    void appendDeleteDescriptor(const unsigned desc_id);
+
+    void appendRemoveImage(const unsigned image_id);
+
+    // Writes and syncs the pending records
+    bool commit();
+
+    // Empties the log once its records are part of a snapshot. Numbering
+    // continues from the last record.
+    bool truncate();
+
+    // Sequence number of the last record appended
+    inline uint64_t lastLsn() const {
+        return next_lsn_ - 1;
+    }
+
+private:
+
+    std::string path_;
+    int fd_;
+    uint64_t next_lsn_;
+    unsigned group_records_;
+    size_t group_bytes_;
+    unsigned npending_;     // 缓存中的记录数目
+    std::string pending_;   // 等待提交的记录
+
+    void append(const unsigned type, const std::string& payload);
+};
+
+// Flushes a written file to the disk
+bool syncFile(const std::string& path);
+
+// Makes the entries of the directory holding path durable, e.g. after a
+// rename into it
+bool syncParentDirectory(const std::string& path);
+
+// Reads the valid records of a log, stopping at the first torn or corrupted
+// record
+class IndexLogReader{
+public:
+
+    explicit IndexLogReader(const std::string& path);
+
+    // Returns false at the end of the valid records
+    bool next(LogRecord* record);
+
+    // Size of the valid prefix read so far
+    inline uint64_t validBytes() const {
+        return valid_bytes_;
+    }
+
+private:
+
+    std::ifstream in_;
+    uint64_t valid_bytes_;
+};
+
+}  // namespace obindex2
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <vector>
+
+#include "binary_tree.h"
+
+namespace obindex2 {
+
+// Searches a batch of descriptors in lock-step. Each query runs the same
+// best-first traversal as ImageIndex::searchDescriptor, split into steps
+// that each touch one level of memory: after a step the query prefetches
+// what its next step reads and gives way to the next query of the group, so
+// the cache misses of the group overlap instead of adding up. The results
+// are identical to searching the queries one at a time.
+class InterleavedSearch{
+public:
+
+    // Constructors
+    InterleavedSearch(const std::vector<BinaryTreePtr>& trees,
+                      const unsigned desc_bytes,
+                      const double epsilon,
+                      const unsigned knn,
+                      const unsigned checks,
+                      const unsigned group = 8);
+
+    // Methods
+
+    // hints is empty or holds one word, or nullptr, per row
+    void search(const DescriptorView& descs,
+                const std::vector<BinaryDescriptorPtr>& hints,
+                std::vector<std::vector<BinaryDescriptorPtr> >* neighs,
+                std::vector<std::vector<HammingDist> >* dists) const;
+
+    // Fused with the ratio test: only the two closest words of each row are
+    // tracked, and a row that fails the test stops searching as soon as no
+    // pending node is likely to hold a word that would make it pass.
+    // best[i] and dists[i] get the closest word of row i if it is within
+    // max_dist and below ratio times the second closest, else best[i] is
+    // nullptr. Returns the number of rejected rows.
+    unsigned searchRatio(const DescriptorView& descs,
+                         const std::vector<BinaryDescriptorPtr>& hints,
+                         const double ratio,
+                         const double max_dist,
+                         BinaryDescriptorPtr* best,
+                         HammingDist* dists) const;
+
+private:
+
+    const std::vector<BinaryTreePtr>& trees_;
+    unsigned desc_bytes_;
+    double epsilon_;
+    unsigned knn_;
+    unsigned checks_;
+    unsigned group_;
+
+    // Traversal shared by both searches, ratio is 0 for the knn search.
+    // finish is called with the state of each finished query.
+    template<typename Finish>
+    void run(const DescriptorView& descs,
+             const std::vector<BinaryDescriptorPtr>& hints,
+             const double ratio,
+             const double max_dist,
+             Finish finish) const;
+};
+
+}  // namespace obindex2
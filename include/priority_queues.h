@@ -1,6 +1,8 @@
 #pragma once
 
 #include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <queue>
 #include <string>
 #include <sstream>
@@ -11,74 +13,129 @@
 
 namespace obindex2{
 
+// Pending node of a best-first search. The node is not owned: the trees are
+// not modified while they are searched.
 struct NodeQueueItem{
 
 public:
 
-    inline explicit NodeQueueItem(const double d,
-                                const unsigned id,
-                                BinaryTreeNodePtr n) :
+    inline NodeQueueItem() :
+        dist(0),
+        tree_id(0),
+        node(nullptr)
+    {}
+
+    inline explicit NodeQueueItem(const HammingDist d,
+                                  const unsigned id,
+                                  BinaryTreeNode* n) :
         dist(d),
-        tree_id(id),
+        tree_id(static_cast<uint16_t>(id)),
         node(n)
     {}
 
-    double dist;
-    unsigned tree_id;
-    BinaryTreeNodePtr node;
+    HammingDist dist;
+    uint16_t tree_id;
+    BinaryTreeNode* node;
 
     inline bool operator<(const NodeQueueItem& item) const {
         return dist < item.dist;
     }
 };
 
-class NodeQueue{
+// Priority queue of items with a small integer dist, one bucket per
+// distance. Push and pop are O(1): the buckets are linked lists threaded
+// through one array of items, and pop scans forward from the smallest
+// non-empty bucket, which only moves back when a closer item is pushed.
+// Items of the same distance are popped last in, first out.
+template<typename Item>
+class BucketQueue{
 public:
-    inline void push(const NodeQueueItem& item){
-        items.push_back(item);
-    }
 
-    inline NodeQueueItem get(unsigned index){
-        return items[index];
+    inline BucketQueue() :
+        min_(0),
+        size_(0)
+    {}
+
+    inline void push(const Item& item){
+
+        if(item.dist >= heads_.size()){
+            heads_.resize(item.dist + 1, -1);
+        }
+
+        items_.push_back(item);
+        next_.push_back(heads_[item.dist]);
+        heads_[item.dist] = static_cast<int>(items_.size()) - 1;
+
+        if(size_ == 0 || item.dist < min_){
+            min_ = item.dist;
+        }
+        size_++;
     }
 
-    inline void sort(){
-        std::sort(items.begin(), items.end());
+    // The closest item, the queue must not be empty
+    inline const Item& top() const {
+        assert(size_ > 0);
+        return items_[heads_[min_]];
     }
 
-    inline unsigned size() const {
-        return items.size();
+    inline void pop(){
+        assert(size_ > 0);
+
+        heads_[min_] = next_[heads_[min_]];
+        size_--;
+
+        if(size_ == 0){
+            clear();
+            return;
+        }
+
+        while(heads_[min_] < 0){
+            min_++;
+        }
     }
 
-private:
-    std::vector<NodeQueueItem> items;
-};
+    inline bool empty() const {
+        return size_ == 0;
+    }
 
-typedef std::shared_ptr<NodeQueue> NodeQueuePtr;
+    inline unsigned size() const {
+        return size_;
+    }
 
-class CompareNodeQueueItem{
-public:
-    inline bool operator()(const NodeQueueItem& a, const NodeQueueItem& b){
-        return a.dist > b.dist;
+    // Empties the queue keeping its storage
+    inline void clear(){
+        std::fill(heads_.begin(), heads_.end(), -1);
+        items_.clear();
+        next_.clear();
+        min_ = 0;
+        size_ = 0;
     }
+
+private:
+    std::vector<Item> items_;
+    std::vector<int> next_;         // Next item of the same bucket, or -1
+    std::vector<int> heads_;        // Last item pushed to each bucket, or -1
+    unsigned min_;                  // Smallest non-empty bucket
+    unsigned size_;
 };
 
-typedef std::priority_queue<NodeQueueItem,
-                            std::vector<NodeQueueItem>,
-                            CompareNodeQueueItem> NodePriorityQueue;
+typedef BucketQueue<NodeQueueItem> NodePriorityQueue;
 
 typedef std::shared_ptr<NodePriorityQueue> NodePriorityQueuePtr;
 
+// Point checked by a search. The descriptor is the element of the leaf set
+// holding it, valid while the trees are not modified.
 struct DescriptorQueueItem{
 public:
 
-    inline explicit DescriptorQueueItem(const double d, BinaryDescriptorPtr bd) :
+    inline explicit DescriptorQueueItem(const HammingDist d,
+                                        const BinaryDescriptorPtr* bd) :
         dist(d),
         desc(bd)
     {}
 
-    double dist;
-    BinaryDescriptorPtr desc;
+    HammingDist dist;
+    const BinaryDescriptorPtr* desc;
 
     inline bool operator<(const DescriptorQueueItem& item) const {
         return dist < item.dist;
@@ -92,7 +149,7 @@ public:
         items.push_back(item);
     }
 
-    inline DescriptorQueueItem get(unsigned index){
+    inline const DescriptorQueueItem& get(unsigned index) const {
         return items[index];
     }
 
@@ -100,14 +157,45 @@ public:
         std::sort(items.begin(), items.end());
     }
 
+    // Sorts only the n closest items
+    inline void sortFirst(const unsigned n){
+        if(n >= items.size()){
+            sort();
+            return;
+        }
+        std::partial_sort(items.begin(), items.begin() + n, items.end());
+    }
+
     inline unsigned size() const {
         return items.size();
     }
 
+    inline void clear(){
+        items.clear();
+    }
+
 private:
     std::vector<DescriptorQueueItem> items;
 };
 
 typedef std::shared_ptr<DescriptorQueue> DescriptorQueuePtr;
 
+// Keeps in best the knn smallest distances among best and r[first, end)
+inline void updateBestDistances(const DescriptorQueue& r,
+                                const unsigned first,
+                                const unsigned knn,
+                                std::priority_queue<HammingDist>* best){
+
+    for(unsigned i = first; i < r.size(); i++){
+        HammingDist dist = r.get(i).dist;
+        if(best->size() < knn){
+            best->push(dist);
+        }
+        else if(knn > 0 && dist < best->top()){
+            best->pop();
+            best->push(dist);
+        }
+    }
+}
+
 }  // namespace obindex2
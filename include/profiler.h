@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace obindex2 {
+
+// Operations of the index with their own latency histogram
+enum ProfileEvent{
+    PROFILE_SEARCH_DESCRIPTORS = 0,
+    PROFILE_SEARCH_IMAGES,
+    PROFILE_ADD_IMAGE_INSERT,
+    PROFILE_ADD_IMAGE_MERGE,
+    PROFILE_ADD_IMAGE_PURGE,
+    PROFILE_TREE_LEAF_SPLIT,
+    PROFILE_REBUILD,
+    PROFILE_NUM_EVENTS
+};
+
+// HDR-style latency histogram in nanoseconds. Values are counted in 2^5
+// linear sub-buckets per power of two, so percentiles have a relative error
+// below 1/32 over the whole range. Recording is lock-free.
+class LatencyHistogram{
+public:
+
+    LatencyHistogram();
+
+    void record(const uint64_t ns);
+    void reset();
+
+    inline uint64_t count() const {
+        return count_.load(std::memory_order_relaxed);
+    }
+
+    inline uint64_t max() const {
+        return max_.load(std::memory_order_relaxed);
+    }
+
+    double mean() const;
+
+    // Upper bound of the bucket holding the p-th percentile, p in [0, 100]
+    uint64_t percentile(const double p) const;
+
+private:
+
+    static const unsigned kSubBits = 5;
+    static const unsigned kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+    std::atomic<uint64_t> counts_[kBuckets];
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+
+    static unsigned bucketIndex(const uint64_t v);
+    static uint64_t bucketUpperBound(const unsigned index);
+};
+
+// Collects the latency of the instrumented operations of all the indices of
+// the process, and optionally a Chrome trace-event file
+// (chrome://tracing, Perfetto) of every operation.
+class Profiler{
+public:
+
+    static Profiler& instance();
+
+    void record(const ProfileEvent event,
+                const std::chrono::steady_clock::time_point& start,
+                const std::chrono::steady_clock::time_point& end);
+
+    inline const LatencyHistogram& histogram(const ProfileEvent event) const {
+        return hists_[event];
+    }
+
+    void reset();
+
+    // p50/p90/p99/max of every operation
+    void printSummary(std::ostream& out) const;
+
+    // Starts recording trace events to filename. Events are buffered and
+    // written every kTraceFlushEvents, so long traces use bounded memory.
+    // stopTrace writes the rest and closes the file
+    bool startTrace(const std::string& filename);
+    bool stopTrace();
+
+    static const char* eventName(const ProfileEvent event);
+
+private:
+
+    struct TraceEvent{
+        ProfileEvent event;
+        double ts_us;       // Start, relative to the profiler creation
+        double dur_us;
+        unsigned tid;
+    };
+
+    static const unsigned kTraceFlushEvents = 8192;
+
+    Profiler();
+
+    // Appends the buffered events to the trace file, trace_mutex_ held
+    void flushTrace();
+
+    LatencyHistogram hists_[PROFILE_NUM_EVENTS];
+    std::chrono::steady_clock::time_point origin_;
+
+    std::atomic<bool> tracing_;
+    std::mutex trace_mutex_;
+    std::ofstream trace_out_;
+    uint64_t trace_written_;        // 已写入文件的事件数目
+    std::vector<TraceEvent> trace_; // 等待写入的事件
+};
+
+// Records the lifetime of the scope as one occurrence of event
+class ScopedProfile{
+public:
+    explicit ScopedProfile(const ProfileEvent event) :
+        event_(event),
+        start_(std::chrono::steady_clock::now())
+    {}
+
+    ~ScopedProfile(){
+        Profiler::instance().record(event_, start_,
+                                    std::chrono::steady_clock::now());
+    }
+
+private:
+    ProfileEvent event_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+}  // namespace obindex2
+
+// Instrumentation is compiled out unless OBINDEX2_PROFILING is defined
+#ifdef OBINDEX2_PROFILING
+#define OBINDEX2_PROFILE_CONCAT_(a, b) a##b
+#define OBINDEX2_PROFILE_CONCAT(a, b) OBINDEX2_PROFILE_CONCAT_(a, b)
+#define OBINDEX2_PROFILE_SCOPE(event) \
+    obindex2::ScopedProfile OBINDEX2_PROFILE_CONCAT(obindex2_profile_, __LINE__)(event)
+#else
+#define OBINDEX2_PROFILE_SCOPE(event)
+#endif
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+namespace obindex2 {
+
+// Writes raw values to a binary stream. Shared by the shard protocol, the
+// write-ahead log and the index snapshots.
+class ByteWriter{
+public:
+    explicit ByteWriter(std::ostream* out) :
+        out_(out)
+    {}
+
+    template<typename T>
+    inline void put(const T& v){
+        out_->write(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    inline void putBytes(const void* data, size_t n){
+        out_->write(reinterpret_cast<const char*>(data), n);
+    }
+
+    inline void putMat(const cv::Mat& m){
+        put<uint32_t>(m.rows);
+        put<uint32_t>(m.cols);
+        for(int i = 0; i < m.rows; i++){
+            putBytes(m.ptr<unsigned char>(i), m.cols);
+        }
+    }
+
+    // Only the position of the keypoints is stored by the index
+    inline void putKeyPoints(const std::vector<cv::KeyPoint>& kps){
+        put<uint32_t>(kps.size());
+        for(unsigned i = 0; i < kps.size(); i++){
+            put<float>(kps[i].pt.x);
+            put<float>(kps[i].pt.y);
+        }
+    }
+
+    inline void putMatches(const std::vector<cv::DMatch>& matches){
+        put<uint32_t>(matches.size());
+        for(unsigned i = 0; i < matches.size(); i++){
+            put<int32_t>(matches[i].queryIdx);
+            put<int32_t>(matches[i].trainIdx);
+            put<int32_t>(matches[i].imgIdx);
+            put<float>(matches[i].distance);
+        }
+    }
+
+    inline bool good() const {
+        return out_->good();
+    }
+
+private:
+    std::ostream* out_;
+};
+
+// Reads values written by ByteWriter. After a short read every value is
+// zero and good() returns false.
+class ByteReader{
+public:
+    explicit ByteReader(std::istream* in) :
+        in_(in)
+    {}
+
+    template<typename T>
+    inline T get(){
+        T v;
+        memset(&v, 0, sizeof(T));
+        in_->read(reinterpret_cast<char*>(&v), sizeof(T));
+        return v;
+    }
+
+    inline void getBytes(void* data, size_t n){
+        in_->read(reinterpret_cast<char*>(data), n);
+    }
+
+    inline cv::Mat getMat(){
+        int rows = get<uint32_t>();
+        int cols = get<uint32_t>();
+        if(!good()){
+            return cv::Mat();
+        }
+
+        cv::Mat m(rows, cols, CV_8U);
+        for(int i = 0; i < rows; i++){
+            getBytes(m.ptr<unsigned char>(i), cols);
+        }
+        return m;
+    }
+
+    inline void getKeyPoints(std::vector<cv::KeyPoint>* kps){
+        unsigned n = get<uint32_t>();
+        kps->resize(good() ? n : 0);
+        for(unsigned i = 0; i < kps->size(); i++){
+            float x = get<float>();
+            float y = get<float>();
+            (*kps)[i].pt = cv::Point2f(x, y);
+        }
+    }
+
+    inline void getMatches(std::vector<cv::DMatch>* matches){
+        unsigned n = get<uint32_t>();
+        matches->resize(good() ? n : 0);
+        for(unsigned i = 0; i < matches->size(); i++){
+            (*matches)[i].queryIdx = get<int32_t>();
+            (*matches)[i].trainIdx = get<int32_t>();
+            (*matches)[i].imgIdx = get<int32_t>();
+            (*matches)[i].distance = get<float>();
+        }
+    }
+
+    inline bool good() const {
+        return in_->good();
+    }
+
+private:
+    std::istream* in_;
+};
+
+}  // namespace obindex2
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "binary_index.h"
+
+namespace obindex2 {
+
+// Serves one ImageIndex over a UNIX-domain socket. A shard holds a part of the
+// words, exposed with the global id local_id * nshards + shard_id, and the
+// postings of every image on them. Images keep their global id in all shards.
+class ShardServer {
+public:
+
+    // Constructors
+
+    // @param socket_path: UNIX socket the shard listens on
+    // @param shard_id
+    // @param nshards
+    // @param k, s, t, merge_policy, purge_descriptors, min_feat_apps:
+    //        parameters of the ImageIndex held by this shard
+    explicit ShardServer(const std::string& socket_path,
+                         const unsigned shard_id,
+                         const unsigned nshards,
+                         const unsigned k = 16,
+                         const unsigned s = 150,
+                         const unsigned t = 4,
+                         const MergePolicy merge_policy = MERGE_POLICY_NONE,
+                         const bool purge_descriptors = true,
+                         const unsigned min_feat_apps = 3);
+
+    // Accepts one coordinator and serves its requests until it shuts the
+    // shard down or closes the connection
+    void run();
+
+private:
+
+    // Handles one request and returns the answer, throws if it failed
+    std::string serve(const unsigned op, const std::string& request);
+
+    std::string socket_path_;
+    unsigned shard_id_;
+    unsigned nshards_;
+    ImageIndex index_;
+};
+
+// Coordinator of an index whose words are partitioned across local shard
+// processes. A matched feature becomes a posting in the shard owning its
+// word, and the unmatched features of image i become new words of shard
+// i % nshards, so the vocabulary and the scores are those of a single index.
+// Images must be added in order starting at 0. Queries are sent to all
+// shards at once and their answers merged. A failure in a shard is thrown
+// by the call that sent the request, the index should not be used after it.
+class ShardedImageIndex {
+public:
+
+    // Constructors
+
+    // Forks nshards processes, each one running a ShardServer listening on
+    // socket_dir/shard_<i>.sock. The index should be created before OpenMP
+    // starts its thread pool in this process, since the shards are forked.
+    explicit ShardedImageIndex(const unsigned nshards,
+                               const std::string& socket_dir,
+                               const unsigned k = 16,
+                               const unsigned s = 150,
+                               const unsigned t = 4,
+                               const MergePolicy merge_policy = MERGE_POLICY_NONE,
+                               const bool purge_descriptors = true,
+                               const unsigned min_feat_apps = 3);
+
+    // Stops the shards and waits for them
+    virtual ~ShardedImageIndex();
+
+    // Methods
+    void addImage(const unsigned image_id,
+                  const std::vector<cv::KeyPoint>& kps,
+                  const cv::Mat& descs);
+
+    // Each match is sent to the shard owning the word
+    void addImage(const unsigned image_id,
+                  const std::vector<cv::KeyPoint>& kps,
+                  const cv::Mat& descs,
+                  const std::vector<cv::DMatch>& matches);
+
+    void searchImages(const cv::Mat& descs,
+                      const std::vector<cv::DMatch>& gmatches,
+                      std::vector<ImageMatch>* img_matches,
+                      bool sort = true);
+
+    void searchDescriptors(const cv::Mat& descs,
+                           std::vector<std::vector<cv::DMatch> >* matches,
+                           const unsigned knn = 2,
+                           const unsigned checks = 32);
+
+    void rebuild();
+
+    inline unsigned numImages(){
+        return nimages_;
+    }
+
+    inline unsigned numShards(){
+        return nshards_;
+    }
+
+    unsigned numDescriptors();
+
+private:
+
+    unsigned nshards_;
+    unsigned nimages_;
+    std::vector<int> pids_;     // 子进程
+    std::vector<int> sockets_;  // 与每个子进程的连接
+
+    // Forks the shards and connects to them, throws if one cannot be
+    // started
+    void startShards(const std::string& socket_dir,
+                     const unsigned k,
+                     const unsigned s,
+                     const unsigned t,
+                     const MergePolicy merge_policy,
+                     const bool purge_descriptors,
+                     const unsigned min_feat_apps);
+
+    // Sends the same request to all the shards
+    void broadcast(const unsigned op, const std::string& payload);
+
+    // Waits for the answers of all the shards, throws if one failed
+    std::vector<std::string> gather();
+};
+
+}  // namespace obindex2
@@ -9,6 +9,7 @@ BinaryDescriptor::BinaryDescriptor(const unsigned nbits) {
     size_in_bytes_ = static_cast<unsigned>(nbits / 8);
     
     bits_ = new unsigned char[size_in_bytes_];
+    owns_bits_ = true;
     
     // Initializing the bits
     memset(bits_, 0, sizeof(unsigned char)*size_in_bytes_);
@@ -16,16 +17,35 @@ BinaryDescriptor::BinaryDescriptor(const unsigned nbits) {
 
 BinaryDescriptor::BinaryDescriptor(const unsigned char* bits, unsigned nbytes) {
     
-    assert(nbytes % 8 == 0);
+    // Any byte width is allowed, e.g. 61 bytes for AKAZE descriptors
+    assert(nbytes > 0);
     
     size_in_bits_ = nbytes * 8;
     size_in_bytes_ = nbytes;
     
     bits_ = new unsigned char[size_in_bytes_];
+    owns_bits_ = true;
     
     memcpy(bits_, bits, sizeof(unsigned char) * nbytes);
 }
 
+BinaryDescriptor::BinaryDescriptor(const unsigned char* bits,
+                                   unsigned nbytes,
+                                   const bool copy) :
+    size_in_bytes_(nbytes),
+    size_in_bits_(nbytes * 8),
+    owns_bits_(copy)
+{
+    if(copy){
+        bits_ = new unsigned char[size_in_bytes_];
+        memcpy(bits_, bits, sizeof(unsigned char) * nbytes);
+    }
+    else{
+        // Only read through this descriptor
+        bits_ = const_cast<unsigned char*>(bits);
+    }
+}
+
 BinaryDescriptor::BinaryDescriptor(const cv::Mat& desc) {
     
     assert(desc.type() == CV_8U);
@@ -33,6 +53,7 @@ BinaryDescriptor::BinaryDescriptor(const cv::Mat& desc) {
     size_in_bytes_ = static_cast<unsigned>(desc.cols);
     size_in_bits_ = size_in_bytes_ * 8;
     bits_ = new unsigned char[size_in_bytes_];
+    owns_bits_ = true;
 
     // Creating the descriptor
     const unsigned char* chars = desc.ptr<unsigned char>(0);
@@ -41,14 +62,17 @@ BinaryDescriptor::BinaryDescriptor(const cv::Mat& desc) {
 
 BinaryDescriptor::BinaryDescriptor(const BinaryDescriptor& bd) :
     size_in_bytes_(bd.size_in_bytes_),
-    size_in_bits_(bd.size_in_bits_)
+    size_in_bits_(bd.size_in_bits_),
+    owns_bits_(true)
 {    
     bits_ = new unsigned char[size_in_bytes_];
     memcpy(bits_, bd.bits_, sizeof(unsigned char) * size_in_bytes_);
 }
 
 BinaryDescriptor::~BinaryDescriptor(){
-    delete [] bits_;
+    if(owns_bits_){
+        delete [] bits_;
+    }
 }
 
 cv::Mat BinaryDescriptor::toCvMat(){
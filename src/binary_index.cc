@@ -1,7 +1,103 @@
 #include "binary_index.h"
 
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <omp.h>
+
+#include "frozen_index.h"
+#include "interleaved_search.h"
+#include "profiler.h"
+#include "serialization.h"
+
 namespace obindex2{
 
+// Snapshot header
+static const uint32_t kSnapshotMagic = 0x3249424f;  // "OBI2"
+static const uint32_t kSnapshotVersion = 1;
+
+// Rows of searchDescriptors searched by one thread
+static const unsigned kSearchBlockRows = 256;
+
+namespace {
+
+// Search of one row by searchDescriptorsDeadline, suspended between
+// backtracking steps
+struct DeadlineSearch{
+    NodePriorityQueue pq;
+    DescriptorQueue r;
+    BinaryDescriptorSet checked;
+    std::priority_queue<HammingDist> best;
+    HammingDist nn_dist[2];         // Two smallest distances found
+    unsigned points_searched;
+    bool done;
+};
+
+// Accounts for the points added to r since first
+void updateDeadlineSearch(const unsigned first,
+                          const unsigned knn,
+                          DeadlineSearch* s){
+
+    for(unsigned i = first; i < s->r.size(); i++){
+        HammingDist dist = s->r.get(i).dist;
+        if(dist < s->nn_dist[0]){
+            s->nn_dist[1] = s->nn_dist[0];
+            s->nn_dist[0] = dist;
+        }
+        else if(dist < s->nn_dist[1]){
+            s->nn_dist[1] = dist;
+        }
+    }
+
+    updateBestDistances(s->r, first, knn, &s->best);
+}
+
+// Same stopping rules as searchDescriptor
+inline bool deadlineSearchFinished(const DeadlineSearch& s,
+                                   const unsigned knn,
+                                   const unsigned checks,
+                                   const double epsilon){
+    return s.points_searched >= checks || s.pq.empty() ||
+           (s.best.size() == knn &&
+            s.pq.top().dist > (1.0 + epsilon) * s.best.top());
+}
+
+// Frees the state of a finished row, keeping only its knn closest points
+void releaseDeadlineSearch(const unsigned knn, DeadlineSearch* s){
+
+    if(s->done){
+        return;
+    }
+
+    s->r.sortFirst(knn);
+    DescriptorQueue r;
+    for(unsigned i = 0; i < std::min(knn, s->r.size()); i++){
+        r.push(s->r.get(i));
+    }
+
+    // r points into the leaves of the trees, checked can go
+    std::swap(s->r, r);
+    s->pq = NodePriorityQueue();
+    BinaryDescriptorSet().swap(s->checked);
+    s->done = true;
+}
+
+// Ratio of the two closest distances: rows near 1 are the most likely to
+// change their match with more backtracking. Rows with less than two
+// points come first.
+inline double ambiguity(const DeadlineSearch& s){
+    if(s.nn_dist[1] == std::numeric_limits<HammingDist>::max()){
+        return 2.0;
+    }
+    return s.nn_dist[1] > 0 ? static_cast<double>(s.nn_dist[0]) / s.nn_dist[1]
+                            : 1.0;
+}
+
+}  // namespace
+
 ImageIndex::ImageIndex(const unsigned k,
                        const unsigned s,
                        const unsigned t,
@@ -14,9 +110,23 @@ ImageIndex::ImageIndex(const unsigned k,
     init_(false),
     nimages_(0),
     ndesc_(0),
+    desc_bytes_(0),
     merge_policy_(merge_policy),
     purge_descriptors_(purge_descriptors),
-    min_feat_apps_(min_feat_apps)
+    min_feat_apps_(min_feat_apps),
+    max_bytes_(0),
+    max_words_(0),
+    max_evictions_(100),
+    nposts_(0),
+    search_epsilon_(kDefaultSearchEpsilon),
+    insert_radius_(0),
+    reorder_queries_(false),
+    build_sample_(0),
+    replaying_(false),
+    first_image_(0),
+    image_window_(0),
+    direct_index_enabled_(false),
+    direct_level_(2)
 {
         
     // Validating the corresponding parameters
@@ -29,175 +139,382 @@ void ImageIndex::addImage(const unsigned image_id,
                           const std::vector<cv::KeyPoint>& kps,
                           const cv::Mat& descs){
     
-    // Creating the set of BinaryDescriptors
-    for(int i = 0; i < descs.rows; i++){
-        
-        // Creating the corresponding descriptor
-        cv::Mat desc = descs.row(i);
+    checkDescriptorWidth(descs.cols);
+    assert(descs.empty() || descs.type() == CV_8U);
+
+    // Logging the update before applying it
+    if(log_ && !replaying_){
+        log_->appendAddImage(image_id, kps, descs);
+    }
+
+    // Bucket collecting the words created by this image
+    if(purge_descriptors_){
+        purge_buckets_.push_back(PurgeBucket(image_id));
+    }
+
+    {
+        OBINDEX2_PROFILE_SCOPE(PROFILE_ADD_IMAGE_INSERT);
+
+        // Creating the set of BinaryDescriptors
+        std::vector<BinaryDescriptorPtr> words;
+        words.reserve(descs.rows);
+
+        for(int i = 0; i < descs.rows; i++){
+            
+            // The only copy of the row, owned by the index
+            BinaryDescriptorPtr d =
+                std::make_shared<BinaryDescriptor>(descs.ptr<unsigned char>(i),
+                                                   desc_bytes_);
+            words.push_back(d);
+
+            // Creating the inverted index item
+            InvIndexItem item;
+            item.image_id = image_id;
+            item.pt = kps[i].pt;
+            item.dist = 0;
+            item.kp_ind = i;
+            inv_index_[d].push_back(item);
+            nposts_++;
+        }
 
-        // 从cv::Mat生成一个智能指针d
-        BinaryDescriptorPtr d = std::make_shared<BinaryDescriptor>(desc);
-        
         // 插入到树中
-        insertDescriptor(d);
+        insertDescriptors(words);
+
+        // Words holding a posting of this image
+        std::vector<unsigned>& image_words = image_words_[image_id];
+        for(unsigned i = 0; i < words.size(); i++){
+            image_words.push_back(desc_to_id_.at(words[i]));
+        }
 
-        // Creating the inverted index item
-        InvIndexItem item;
-        item.image_id = image_id;
-        item.pt = kps[i].pt;
-        item.dist = 0.0;
-        item.kp_ind = i;
-        inv_index_[d].push_back(item);
+        // If the trees are not initialized, we build them
+        if(!init_){
+
+            assert(static_cast<int>(k_) < descs.rows);
+            initTrees();
+            init_ = true;
+        }
     }
 
-    // If the trees are not initialized, we build them
-    if(!init_){
+    {
+        OBINDEX2_PROFILE_SCOPE(PROFILE_ADD_IMAGE_PURGE);
 
-        assert(static_cast<int>(k_) < descs.rows);
-        initTrees();
-        init_ = true;
+        // Deleting unstable features
+        if(purge_descriptors_){
+            purgeDescriptors(image_id);
+        }
+
+        // Keeping the index under the memory budget
+        evictDescriptors();
     }
 
-    // Deleting unstable features
-    if(purge_descriptors_){
-        purgeDescriptors(image_id);
+    if(direct_index_enabled_){
+        addToDirectIndex(image_id, kps, descs);
     }
 
     nimages_++;
+
+    // Keeping only the last images of the window
+    retireImages();
 }
 
 void ImageIndex::addImage(const unsigned image_id,
                 const std::vector<cv::KeyPoint>& kps,
                 const cv::Mat& descs,
-                const std::vector<cv::DMatch>& matches){
+                const std::vector<cv::DMatch>& input_matches){
   
-    // --- Adding new features
-    // All features
-    std::set<int> points;
-    for(unsigned feat_ind = 0; feat_ind < kps.size(); feat_ind++){
-        points.insert(feat_ind);
+    checkDescriptorWidth(descs.cols);
+    assert(descs.empty() || descs.type() == CV_8U);
+
+    // Near-duplicates of existing words are added as matches. They are
+    // logged as such, so the replay does not depend on the trees.
+    std::vector<cv::DMatch> extended_matches;
+    if(insert_radius_ > 0 && init_ && !replaying_){
+        extended_matches = input_matches;
+        if(matchNearDuplicates(descs, &extended_matches) == 0){
+            extended_matches.clear();
+        }
+    }
+    const std::vector<cv::DMatch>& matches =
+                extended_matches.empty() ? input_matches : extended_matches;
+
+    // Logging the update before applying it
+    if(log_ && !replaying_){
+        log_->appendAddImage(image_id, kps, descs, matches);
     }
 
-    // Matched features
-    std::set<int> matched_points;
-    for(unsigned match_ind = 0; match_ind < matches.size(); match_ind++){
-        matched_points.insert(matches[match_ind].queryIdx);
+    // Bucket collecting the words created by this image
+    if(purge_descriptors_){
+        purge_buckets_.push_back(PurgeBucket(image_id));
     }
 
-    // Computing the difference
-    std::set<int> diff;
-    std::set_difference(points.begin(), points.end(),
-                        matched_points.begin(), matched_points.end(),
-                        std::inserter(diff, diff.end()));
+    {
+        OBINDEX2_PROFILE_SCOPE(PROFILE_ADD_IMAGE_INSERT);
 
-    // Inserting new features into the index.
-    for(auto it = diff.begin(); it != diff.end(); it++){
-        int index = *it;
-        cv::Mat desc = descs.row(index);
-        BinaryDescriptorPtr d = std::make_shared<BinaryDescriptor>(desc);
-        insertDescriptor(d);
+        // --- Adding new features
+        // All features
+        std::set<int> points;
+        for(unsigned feat_ind = 0; feat_ind < kps.size(); feat_ind++){
+            points.insert(feat_ind);
+        }
+
+        // Matched features
+        std::set<int> matched_points;
+        for(unsigned match_ind = 0; match_ind < matches.size(); match_ind++){
+            matched_points.insert(matches[match_ind].queryIdx);
+        }
+
+        // Computing the difference
+        std::set<int> diff;
+        std::set_difference(points.begin(), points.end(),
+                            matched_points.begin(), matched_points.end(),
+                            std::inserter(diff, diff.end()));
+
+        // Inserting new features into the index.
+        std::vector<BinaryDescriptorPtr> words;
+        words.reserve(diff.size());
+
+        for(auto it = diff.begin(); it != diff.end(); it++){
+            int index = *it;
+            BinaryDescriptorPtr d =
+                std::make_shared<BinaryDescriptor>(descs.ptr<unsigned char>(index),
+                                                   desc_bytes_);
+            words.push_back(d);
+
+            // Creating the inverted index item
+            InvIndexItem item;
+            item.image_id = image_id;
+            item.pt = kps[index].pt;
+            item.dist = 0;
+            item.kp_ind = index;
+            inv_index_[d].push_back(item);
+            nposts_++;
+        }
+
+        insertDescriptors(words);
 
-        // Creating the inverted index item
-        InvIndexItem item;
-        item.image_id = image_id;
-        item.pt = kps[index].pt;
-        item.dist = 0.0;
-        item.kp_ind = index;
-        inv_index_[d].push_back(item);
+        // Words holding a posting of this image
+        std::vector<unsigned>& image_words = image_words_[image_id];
+        for(unsigned i = 0; i < words.size(); i++){
+            image_words.push_back(desc_to_id_.at(words[i]));
+        }
     }
 
-    // --- Updating the matched descriptors into the index
-    for(unsigned match_ind = 0; match_ind < matches.size(); match_ind++){
-        int qindex = matches[match_ind].queryIdx;
-        int tindex = matches[match_ind].trainIdx;
+    {
+        OBINDEX2_PROFILE_SCOPE(PROFILE_ADD_IMAGE_MERGE);
+
+        // --- Updating the matched descriptors into the index
+        for(unsigned match_ind = 0; match_ind < matches.size(); match_ind++){
+            int qindex = matches[match_ind].queryIdx;
+            int tindex = matches[match_ind].trainIdx;
 
-        BinaryDescriptorPtr q_d = std::make_shared<BinaryDescriptor>
-                                                                (descs.row(qindex));
-        BinaryDescriptorPtr t_d = id_to_desc_[tindex];
+            // The query row is only read, so it is not copied
+            BinaryDescriptor q_d(descs.ptr<unsigned char>(qindex), desc_bytes_, false);
+            BinaryDescriptorPtr t_d = id_to_desc_[tindex];
 
-        // Merge and replace according to the merging policy
-        if(merge_policy_ == MERGE_POLICY_AND){
-            *t_d &= *q_d;
+            // Merge and replace according to the merging policy
+            if(merge_policy_ == MERGE_POLICY_AND){
+                *t_d &= q_d;
+            }
+            else if(merge_policy_ == MERGE_POLICY_OR){
+                *t_d |= q_d;
+            }
+
+            // Creating the inverted index item
+            InvIndexItem item;
+            item.image_id = image_id;
+            item.pt = kps[qindex].pt;
+            item.dist = static_cast<HammingDist>(matches[match_ind].distance);
+            item.kp_ind = qindex;
+            inv_index_[t_d].push_back(item);
+            nposts_++;
+            image_words_[image_id].push_back(tindex);
+
+            // The word has just been matched
+            touchDescriptor(t_d);
         }
-        else if(merge_policy_ == MERGE_POLICY_OR){
-            *t_d |= *q_d;
+    }
+
+    {
+        OBINDEX2_PROFILE_SCOPE(PROFILE_ADD_IMAGE_PURGE);
+
+        // Deleting unstable features
+        if(purge_descriptors_){
+            purgeDescriptors(image_id);
         }
 
-        // Creating the inverted index item
-        InvIndexItem item;
-        item.image_id = image_id;
-        item.pt = kps[qindex].pt;
-        item.dist = matches[match_ind].distance;
-        item.kp_ind = qindex;
-        inv_index_[t_d].push_back(item);
+        // Keeping the index under the memory budget
+        evictDescriptors();
     }
 
-    // Deleting unstable features
-    if(purge_descriptors_){
-        purgeDescriptors(image_id);
+    if(direct_index_enabled_){
+        addToDirectIndex(image_id, kps, descs);
     }
 
     nimages_++;
+
+    // Keeping only the last images of the window
+    retireImages();
 }
 
 void ImageIndex::searchImages(const cv::Mat& descs,
                               const std::vector<cv::DMatch>& gmatches,
                               std::vector<ImageMatch>* img_matches,
                               bool sort){
+    OBINDEX2_PROFILE_SCOPE(PROFILE_SEARCH_IMAGES);
+
+    // One buffer per thread, so concurrent searches do not share it. The
+    // buffer is left cleared, so it can be reused by any index
+    static thread_local ScoreBuffer buf;
+
+    scoreImages(descs.rows, gmatches, numActiveImages(), &buf);
+    collectImageScores(nimages_, &buf, img_matches, sort, &removed_images_);
+}
+
+void ImageIndex::searchImagesBatch(
+                        const std::vector<cv::Mat>& descs,
+                        const std::vector<std::vector<cv::DMatch> >& gmatches,
+                        std::vector<std::vector<ImageMatch> >* img_matches,
+                        bool sort){
+
+    assert(descs.size() == gmatches.size());
+    img_matches->resize(descs.size());
+
+    #pragma omp parallel
+    {
+        // One buffer per thread, reused for all its frames
+        ScoreBuffer buf;
+
+        #pragma omp for schedule(dynamic)
+        for(int f = 0; f < static_cast<int>(descs.size()); f++){
+            scoreImages(descs[f].rows, gmatches[f], numActiveImages(), &buf);
+            collectImageScores(nimages_, &buf, &(*img_matches)[f], sort,
+                               &removed_images_);
+        }
+    }
+}
+
+void ImageIndex::scoreImages(const unsigned nqueries,
+                             const std::vector<cv::DMatch>& gmatches,
+                             const unsigned total_images,
+                             ScoreBuffer* buf) const {
     
-    // Initializing the resulting structure
-    img_matches->resize(nimages_);
-    
-    for(unsigned i = 0; i < nimages_; i++){
-        img_matches->at(i).image_id = i;
+    // Scores are kept from the oldest image not removed, so the buffer does
+    // not grow with the images removed. All the scores are zero between
+    // queries and old stamps are below the next ones, so it can be shifted.
+    unsigned span = nimages_ - first_image_;
+    buf->base = first_image_;
+    if(buf->scores.size() < span){
+        buf->scores.resize(span, 0.0);
+        buf->seen.resize(span, 0);
     }
 
     // Counting the number of each word in the current document
-    std::unordered_map<int, int> nwi_map;
+    std::unordered_map<int, int>& nwi_map = buf->nwi;
+    nwi_map.clear();
     
     for(unsigned match_index = 0; match_index < gmatches.size(); match_index++){
         
-        int train_idx = gmatches[match_index].trainIdx;
-        
         // Updating nwi_map, number of occurrences of a word in an image.
-        
-        if(nwi_map.count(train_idx))
-            nwi_map[train_idx]++;
-        else
-            nwi_map[train_idx] = 1;
-        
+        nwi_map[gmatches[match_index].trainIdx]++;
     }
 
     // We process all the matchings again to increase the scores
     for(unsigned match_index = 0; match_index < gmatches.size(); match_index++){
         
         int train_idx = gmatches[match_index].trainIdx;
-        BinaryDescriptorPtr desc = id_to_desc_[train_idx];
+
+        // The word may have been removed since it was matched
+        auto desc_it = id_to_desc_.find(train_idx);
+        if(desc_it == id_to_desc_.end()){
+            continue;
+        }
+
+        const std::vector<InvIndexItem>& posts = inv_index_.at(desc_it->second);
 
         // Computing the TF term
-        double tf = static_cast<double>(nwi_map[train_idx]) / descs.rows;
+        double tf = static_cast<double>(nwi_map[train_idx]) / nqueries;
 
-        // Computing the IDF term
-        std::unordered_set<unsigned> nw;
-        
-        for(unsigned i = 0; i < inv_index_[desc].size(); i++)
-            nw.insert(inv_index_[desc][i].image_id);
+        // Computing the IDF term, counting each image once
+        buf->stamp++;
+        unsigned nw = 0;
         
+        for(unsigned i = 0; i < posts.size(); i++){
+            unsigned im = posts[i].image_id - buf->base;
+            if(buf->seen[im] != buf->stamp){
+                buf->seen[im] = buf->stamp;
+                nw++;
+            }
+        }
 
-        double idf = log(static_cast<double>(nimages_) / nw.size());
+        double idf = log(static_cast<double>(total_images) / nw);
 
         // Computing the final TF-IDF weighting term
         double tfidf = tf * idf;
 
-        for(unsigned i = 0; i < inv_index_[desc].size(); i++){
-            int im = inv_index_[desc][i].image_id;
-            img_matches->at(im).score += tfidf;
+        for(unsigned i = 0; i < posts.size(); i++){
+            unsigned im = posts[i].image_id;
+            if(buf->scores[im - buf->base] == 0.0){
+                buf->touched.push_back(im);
+            }
+            buf->scores[im - buf->base] += tfidf;
+        }
+    }
+}
+
+void collectImageScores(const unsigned nimages,
+                        ScoreBuffer* buf,
+                        std::vector<ImageMatch>* img_matches,
+                        const bool sort,
+                        const std::set<unsigned>* removed){
+
+    unsigned nremoved = removed ? removed->size() : 0;
+    img_matches->resize(nimages - buf->base - nremoved);
+
+    if(!sort){
+        unsigned pos = 0;
+        for(unsigned i = buf->base; i < nimages; i++){
+            if(removed && removed->count(i)){
+                continue;
+            }
+            unsigned s = i - buf->base;
+            img_matches->at(pos).image_id = i;
+            img_matches->at(pos).score = s < buf->scores.size() ? buf->scores[s] : 0.0;
+            pos++;
+        }
+    }
+    else{
+
+        // Images with some score, duplicates removed
+        std::sort(buf->touched.begin(), buf->touched.end());
+        buf->touched.erase(std::unique(buf->touched.begin(), buf->touched.end()),
+                           buf->touched.end());
+
+        unsigned pos = 0;
+        for(unsigned i = 0; i < buf->touched.size(); i++){
+            unsigned im = buf->touched[i];
+            img_matches->at(pos++) = ImageMatch(im, buf->scores[im - buf->base]);
+        }
+
+        std::stable_sort(img_matches->begin(), img_matches->begin() + pos);
+
+        // The remaining images, by id
+        unsigned next = buf->base;
+        for(unsigned i = 0; i <= buf->touched.size(); i++){
+            unsigned end = i < buf->touched.size() ? buf->touched[i] : nimages;
+            for(; next < end; next++){
+                if(!removed || !removed->count(next)){
+                    img_matches->at(pos++) = ImageMatch(next, 0.0);
+                }
+            }
+            next = end + 1;
         }
     }
 
-    if(sort){
-        std::sort(img_matches->begin(), img_matches->end());
+    // Resetting only the touched entries
+    for(unsigned i = 0; i < buf->touched.size(); i++){
+        buf->scores[buf->touched[i] - buf->base] = 0.0;
     }
+    buf->touched.clear();
 }
 
 void ImageIndex::initTrees(){
@@ -207,247 +524,1741 @@ void ImageIndex::initTrees(){
     // 包装成智能指针
     BinaryDescriptorSetPtr dset_ptr = std::make_shared<BinaryDescriptorSet>(dset_);
 
-    // 需要生成t个树
+    // 需要生成t个树, 每棵树由一个线程构建
+    trees_.resize(t_);
+
+    // A sampled build spreads each tree over all the threads
+    if(build_sample_ > 0 && dset_.size() > build_sample_){
+        for(unsigned i = 0; i < t_; i++){
+            trees_[i] = std::make_shared<BinaryTree>(dset_ptr, i, k_, s_,
+                                                     build_sample_);
+        }
+        return;
+    }
+
+    #pragma omp parallel for
     for(unsigned i = 0; i < t_; i++){
-        
-        BinaryTreePtr tree_ptr = std::make_shared<BinaryTree>(dset_ptr, i, k_, s_);
-        trees_.push_back(tree_ptr);
+        trees_[i] = std::make_shared<BinaryTree>(dset_ptr, i, k_, s_);
+    }
+}
+
+void ImageIndex::checkDescriptorWidth(const unsigned cols){
+
+    // An image without features says nothing of the width
+    if(cols == 0){
+        return;
+    }
+
+    // Distances are stored in 16 bits
+    assert(cols * 8 <= std::numeric_limits<HammingDist>::max());
+
+    if(desc_bytes_ == 0){
+        desc_bytes_ = cols;
     }
+
+    assert(cols == desc_bytes_);
+}
+
+void ImageIndex::searchDescriptors(const cv::Mat& descs,
+                                   std::vector<std::vector<cv::DMatch>>* matches,
+                                   const unsigned knn,
+                                   const unsigned checks){
+    searchDescriptors(DescriptorView(descs), matches, knn, checks);
+}
+
+void ImageIndex::searchDescriptors(const DescriptorView& descs,
+                                   std::vector<std::vector<cv::DMatch>>* matches,
+                                   const unsigned knn,
+                                   const unsigned checks){
+    searchDescriptors(descs, std::vector<int>(), matches, knn, checks);
 }
 
 void ImageIndex::searchDescriptors(const cv::Mat& descs,
+                                   const std::vector<int>& hints,
+                                   std::vector<std::vector<cv::DMatch>>* matches,
+                                   const unsigned knn,
+                                   const unsigned checks){
+    searchDescriptors(DescriptorView(descs), hints, matches, knn, checks);
+}
+
+void ImageIndex::searchDescriptors(const DescriptorView& descs,
+                                   const std::vector<int>& hints,
                                    std::vector<std::vector<cv::DMatch>>* matches,
                                    const unsigned knn,
                                    const unsigned checks){
+    OBINDEX2_PROFILE_SCOPE(PROFILE_SEARCH_DESCRIPTORS);
+
+    assert(hints.empty() || hints.size() == descs.rows);
+
     matches->clear();
+    matches->resize(descs.rows);
+    checkDescriptorWidth(descs.cols);
+
+    std::vector<BinaryDescriptorPtr> hint_words;
+    hintWords(hints, &hint_words);
+
+    // Unless the rows are reordered, they are searched straight out of the
+    // caller's memory
+    DescriptorView queries = descs;
+    std::vector<unsigned> order;
+    std::vector<unsigned char> reordered;
+    if(reorder_queries_ && init_){
+        reorderQueries(descs, &order, &reordered);
+        queries = DescriptorView(reordered.data(), descs.rows, descs.cols,
+                                 descs.cols);
+        permuteHints(order, &hint_words);
+    }
 
-    for(int i = 0; i < descs.rows; i++){
-        
-        // Creating the corresponding descriptor
-        cv::Mat desc = descs.row(i);
-        BinaryDescriptorPtr d = std::make_shared<BinaryDescriptor>(desc);
+    // Blocks of rows are searched in parallel. Inside a block the rows
+    // advance through the trees in lock-step
+    InterleavedSearch search(trees_, desc_bytes_, search_epsilon_, knn, checks);
+    int nblocks = (descs.rows + kSearchBlockRows - 1) / kSearchBlockRows;
 
-        // Searching the descriptor in the index
-        std::vector<BinaryDescriptorPtr> neighs;
-        std::vector<double> dists;
-        
-        searchDescriptor(d, &neighs, &dists, knn, checks);
+    #pragma omp parallel for schedule(dynamic)
+    for(int b = 0; b < nblocks; b++){
 
-        // Translating the resulting matches to CV structures
-        std::vector<cv::DMatch> des_match;
-        for(unsigned j = 0; j < neighs.size(); j++){
-            cv::DMatch match;
-            match.queryIdx = i;
-            match.trainIdx = static_cast<int>(desc_to_id_[neighs[j]]);
-            match.imgIdx = static_cast<int>(inv_index_[neighs[j]][0].image_id);
-            match.distance = dists[j];
-            des_match.push_back(match);
+        unsigned first = b * kSearchBlockRows;
+        unsigned nrows = std::min(kSearchBlockRows, descs.rows - first);
+        DescriptorView block(queries.row(first), nrows, queries.cols,
+                             queries.stride);
+
+        std::vector<BinaryDescriptorPtr> block_hints;
+        if(!hint_words.empty()){
+            block_hints.assign(hint_words.begin() + first,
+                               hint_words.begin() + first + nrows);
         }
 
-        matches->push_back(des_match);
+        std::vector<std::vector<BinaryDescriptorPtr> > neighs;
+        std::vector<std::vector<HammingDist> > dists;
+        search.search(block, block_hints, &neighs, &dists);
+
+        // Translating the resulting matches to CV structures, at the
+        // original row
+        for(unsigned i = 0; i < nrows; i++){
+            unsigned row = order.empty() ? first + i : order[first + i];
+            translateMatches(row, neighs[i], dists[i], &(*matches)[row]);
+        }
     }
 }
 
-void ImageIndex::deleteDescriptor(const unsigned desc_id){
-    BinaryDescriptorPtr d = id_to_desc_[desc_id];
-    // Clearing the descriptor
-    deleteDescriptor(d);
+unsigned ImageIndex::searchDescriptorsRatio(const cv::Mat& descs,
+                                            std::vector<cv::DMatch>* matches,
+                                            const double ratio,
+                                            const double max_dist,
+                                            const unsigned checks){
+    return searchDescriptorsRatio(DescriptorView(descs), std::vector<int>(),
+                                  matches, ratio, max_dist, checks);
 }
 
-void ImageIndex::searchDescriptor(BinaryDescriptorPtr q,                    // input  query describtor
-                                  std::vector<BinaryDescriptorPtr>* neigh,  // output neighbour decrib
-                                  std::vector<double>* distances,           // output distance
-                                  unsigned knn,
-                                  unsigned checks){
-    
-    unsigned points_searched = 0;
-    
-    NodePriorityQueue pq;
-    DescriptorQueue r;
+unsigned ImageIndex::searchDescriptorsRatio(const DescriptorView& descs,
+                                            std::vector<cv::DMatch>* matches,
+                                            const double ratio,
+                                            const double max_dist,
+                                            const unsigned checks){
+    return searchDescriptorsRatio(descs, std::vector<int>(),
+                                  matches, ratio, max_dist, checks);
+}
 
-    // Initializing search structures
-    std::vector<NodeQueuePtr> pqs;
-    std::vector<DescriptorQueuePtr> rs;
-    
-    for(unsigned i = 0; i < trees_.size(); i++){
-        NodeQueuePtr tpq = std::make_shared<NodeQueue>();
-        pqs.push_back(tpq);
+unsigned ImageIndex::searchDescriptorsRatio(const DescriptorView& descs,
+                                            const std::vector<int>& hints,
+                                            std::vector<cv::DMatch>* matches,
+                                            const double ratio,
+                                            const double max_dist,
+                                            const unsigned checks){
+    OBINDEX2_PROFILE_SCOPE(PROFILE_SEARCH_DESCRIPTORS);
+
+    assert(hints.empty() || hints.size() == descs.rows);
+
+    // One slot per row, the accepted matches of each block are written from
+    // the first slot of the block and packed afterwards
+    matches->resize(descs.rows);
+    checkDescriptorWidth(descs.cols);
+
+    std::vector<BinaryDescriptorPtr> hint_words;
+    hintWords(hints, &hint_words);
+
+    DescriptorView queries = descs;
+    std::vector<unsigned> order;
+    std::vector<unsigned char> reordered;
+    if(reorder_queries_ && init_){
+        reorderQueries(descs, &order, &reordered);
+        queries = DescriptorView(reordered.data(), descs.rows, descs.cols,
+                                 descs.cols);
+        permuteHints(order, &hint_words);
+    }
+
+    InterleavedSearch search(trees_, desc_bytes_, search_epsilon_, 2, checks);
+    int nblocks = (descs.rows + kSearchBlockRows - 1) / kSearchBlockRows;
+    std::vector<unsigned> naccepted(nblocks, 0);
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int b = 0; b < nblocks; b++){
 
-        DescriptorQueuePtr tr = std::make_shared<DescriptorQueue>();
-        rs.push_back(tr);
+        unsigned first = b * kSearchBlockRows;
+        unsigned nrows = std::min(kSearchBlockRows, descs.rows - first);
+        DescriptorView block(queries.row(first), nrows, queries.cols,
+                             queries.stride);
+
+        std::vector<BinaryDescriptorPtr> block_hints;
+        if(!hint_words.empty()){
+            block_hints.assign(hint_words.begin() + first,
+                               hint_words.begin() + first + nrows);
+        }
+
+        BinaryDescriptorPtr best[kSearchBlockRows];
+        HammingDist dists[kSearchBlockRows];
+        search.searchRatio(block, block_hints, ratio, max_dist, best, dists);
+
+        // Only the accepted words are translated
+        cv::DMatch* out = &(*matches)[first];
+        for(unsigned i = 0; i < nrows; i++){
+            if(best[i]){
+                out->queryIdx = order.empty() ? first + i : order[first + i];
+                out->trainIdx = static_cast<int>(desc_to_id_.at(best[i]));
+                out->imgIdx = static_cast<int>(inv_index_.at(best[i])[0].image_id);
+                out->distance = dists[i];
+                out++;
+            }
+        }
+        naccepted[b] = out - &(*matches)[first];
     }
 
-    // Searching in the trees
-    #pragma omp parallel for
-    for(unsigned i = 0; i < trees_.size(); i++){
-        trees_[i]->traverseFromRoot(q, pqs[i], rs[i]);
+    unsigned n = 0;
+    for(int b = 0; b < nblocks; b++){
+        auto src = matches->begin() + b * kSearchBlockRows;
+        std::copy(src, src + naccepted[b], matches->begin() + n);
+        n += naccepted[b];
+    }
+    matches->resize(n);
+
+    // Back to the order of the rows
+    if(!order.empty()){
+        std::sort(matches->begin(), matches->end(),
+                  [](const cv::DMatch& a, const cv::DMatch& b){
+                      return a.queryIdx < b.queryIdx;
+                  });
     }
 
-    //  Gathering results from each individual search
-    std::unordered_set<BinaryDescriptorPtr> already_added;
+    return descs.rows - n;
+}
 
-    for(unsigned i = 0; i < trees_.size(); i++){
-        
-        // Obtaining descriptor nodes
-        unsigned r_size = rs[i]->size();
-        
-        for(unsigned j = 0; j < r_size; j++){
+void ImageIndex::searchDescriptorsDeadline(
+                        const cv::Mat& descs,
+                        std::vector<std::vector<cv::DMatch> >* matches,
+                        const unsigned budget_us,
+                        std::vector<unsigned>* truncated,
+                        const unsigned knn,
+                        const unsigned checks){
+    searchDescriptorsDeadline(DescriptorView(descs), matches, budget_us,
+                              truncated, knn, checks);
+}
 
-            DescriptorQueueItem r_item = rs[i]->get(j);
+void ImageIndex::searchDescriptorsDeadline(
+                        const DescriptorView& descs,
+                        std::vector<std::vector<cv::DMatch> >* matches,
+                        const unsigned budget_us,
+                        std::vector<unsigned>* truncated,
+                        const unsigned knn,
+                        const unsigned checks){
+    OBINDEX2_PROFILE_SCOPE(PROFILE_SEARCH_DESCRIPTORS);
 
-            std::pair<std::unordered_set<BinaryDescriptorPtr>::iterator, bool> result;
-            
-            result = already_added.insert(r_item.desc);
-            
-            if(result.second){
-                r.push(r_item);
-                points_searched++;
-            }
+    const std::chrono::steady_clock::time_point deadline =
+                            std::chrono::steady_clock::now() +
+                            std::chrono::microseconds(budget_us);
+
+    matches->clear();
+    matches->resize(descs.rows);
+    truncated->clear();
+    checkDescriptorWidth(descs.cols);
+
+    std::vector<DeadlineSearch> searches(descs.rows);
+
+    // Every row descends all the trees, whatever the budget
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int i = 0; i < static_cast<int>(descs.rows); i++){
+
+        BinaryDescriptor q(descs.row(i), desc_bytes_, false);
+        DeadlineSearch& s = searches[i];
+        s.nn_dist[0] = std::numeric_limits<HammingDist>::max();
+        s.nn_dist[1] = std::numeric_limits<HammingDist>::max();
+        s.points_searched = 0;
+        s.done = false;
+
+        for(unsigned t = 0; t < trees_.size(); t++){
+            unsigned first = s.r.size();
+            s.points_searched += trees_[t]->traverseFromRoot(q, &s.pq, &s.r,
+                                                             &s.checked);
+            updateDeadlineSearch(first, knn, &s);
         }
     }
 
-    // Continuing the search if not enough descriptors have been checked
-    if(points_searched < checks){
-        
-        // Gathering the next nodes to search
-        for(unsigned i = 0; i < trees_.size(); i++){
-            
-            // Obtaining priority queue nodes
-            unsigned pq_size = pqs[i]->size();
-            
-            for(unsigned j = 0; j < pq_size; j++){
-                pq.push(pqs[i]->get(j));
-            }
+    // The rest of the budget goes to backtracking, one node at a time, the
+    // most ambiguous row of each chunk of rows first
+    int nchunks = std::min<int>(omp_get_max_threads(), descs.rows);
+    std::vector<std::vector<unsigned> > chunk_truncated(nchunks);
+
+    #pragma omp parallel for schedule(static, 1)
+    for(int c = 0; c < nchunks; c++){
+
+        unsigned first_row = static_cast<uint64_t>(descs.rows) * c / nchunks;
+        unsigned end_row = static_cast<uint64_t>(descs.rows) * (c + 1) / nchunks;
+
+        std::priority_queue<std::pair<double, unsigned> > pending;
+        for(unsigned i = first_row; i < end_row; i++){
+            pending.push(std::make_pair(ambiguity(searches[i]), i));
         }
 
-        NodePriorityQueuePtr pq_ptr = std::make_shared<NodePriorityQueue>(pq);
-        
-        while(points_searched < checks && !pq.empty()){
-            // Get the closest node to continue the search
-            NodeQueueItem n = pq.top();
-            pq.pop();
-
-            // Searching in the node
-            NodeQueuePtr tpq = std::make_shared<NodeQueue>();
-            DescriptorQueuePtr tr = std::make_shared<DescriptorQueue>();
-            trees_[n.tree_id]->traverseFromNode(q, n.node, tpq, tr);
-
-            // Adding new nodes to search to PQ
-            for(unsigned i = 0; i < tpq->size(); i++){
-                pq.push(tpq->get(i));
-            }
-
-            for(unsigned j = 0; j < tr->size(); j++){
-                DescriptorQueueItem r_item = tr->get(j);
-                std::pair<std::unordered_set<BinaryDescriptorPtr>::iterator,
-                        bool > result;
-                result = already_added.insert(r_item.desc);
-                if(result.second){
-                    r.push(r_item);
-                    points_searched++;
+        // Releasing the rows still pending takes time after the deadline,
+        // it is estimated from the rows released so far
+        double release_ns = 0.0;
+        unsigned nreleased = 0;
+
+        auto expired = [&](){
+            double reserve_ns = nreleased > 0 ?
+                                release_ns / nreleased * pending.size() : 0.0;
+            return std::chrono::steady_clock::now() +
+                   std::chrono::nanoseconds(static_cast<int64_t>(reserve_ns)) >=
+                   deadline;
+        };
+
+        while(!pending.empty() && !expired()){
+
+            unsigned i = pending.top().second;
+            pending.pop();
+            DeadlineSearch& s = searches[i];
+            BinaryDescriptor q(descs.row(i), desc_bytes_, false);
+
+            // The row goes on while it is the most ambiguous one
+            double amb = ambiguity(s);
+            while(!deadlineSearchFinished(s, knn, checks, search_epsilon_) &&
+                  (pending.empty() || amb >= pending.top().first)){
+
+                NodeQueueItem n = s.pq.top();
+                s.pq.pop();
+
+                unsigned first = s.r.size();
+                s.points_searched += trees_[n.tree_id]->traverseFromNode(
+                                                q, n.node, &s.pq, &s.r, &s.checked);
+                updateDeadlineSearch(first, knn, &s);
+                amb = ambiguity(s);
+
+                if(std::chrono::steady_clock::now() >= deadline){
+                    break;
                 }
             }
+
+            // The state of a finished row is released right away
+            if(deadlineSearchFinished(s, knn, checks, search_epsilon_)){
+                auto start = std::chrono::steady_clock::now();
+                releaseDeadlineSearch(knn, &s);
+                release_ns += std::chrono::duration<double, std::nano>(
+                                    std::chrono::steady_clock::now() - start).count();
+                nreleased++;
+            }
+            else{
+                pending.push(std::make_pair(amb, i));
+            }
         }
-    }
 
-    r.sort();
+        // Rows left pending were cut by the deadline, unless they had
+        // nothing left to search
+        while(!pending.empty()){
 
-    // Returning the required number of descriptors descriptors
-    neigh->clear();
-    distances->clear();
-    unsigned ndescs = std::min(knn, r.size());
-    
-    for(unsigned i = 0; i < ndescs; i++){
-        DescriptorQueueItem d = r.get(i);
+            unsigned i = pending.top().second;
+            pending.pop();
 
-        neigh->push_back(d.desc);
-        distances->push_back(d.dist);
+            if(!deadlineSearchFinished(searches[i], knn, checks,
+                                       search_epsilon_)){
+                chunk_truncated[c].push_back(i);
+            }
+        }
     }
 
-}
-
-void ImageIndex::insertDescriptor(BinaryDescriptorPtr q){
-    
-    // 插入到unordered_set中
-    dset_.insert(q);
+    for(int c = 0; c < nchunks; c++){
+        truncated->insert(truncated->end(), chunk_truncated[c].begin(),
+                          chunk_truncated[c].end());
+    }
+    std::sort(truncated->begin(), truncated->end());
 
-    desc_to_id_[q] = ndesc_;
-    id_to_desc_[ndesc_] = q;
-    ndesc_++;
+    // Translating the best points found so far
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(int i = 0; i < static_cast<int>(descs.rows); i++){
 
-    // 加入到最近添加的描述子中, 做进一步的筛选
-    recently_added_.push_back(q);
+        releaseDeadlineSearch(knn, &searches[i]);
+        const DescriptorQueue& r = searches[i].r;
 
-    // Indexing the descriptor inside each tree
-    if(init_){
-        #pragma omp parallel for
-        for(unsigned i = 0; i < trees_.size(); i++){
-            trees_[i]->addDescriptor(q);
+        std::vector<BinaryDescriptorPtr> neighs;
+        std::vector<HammingDist> dists;
+        unsigned ndescs = std::min(knn, r.size());
+        for(unsigned j = 0; j < ndescs; j++){
+            neighs.push_back(*r.get(j).desc);
+            dists.push_back(r.get(j).dist);
         }
+
+        translateMatches(i, neighs, dists, &(*matches)[i]);
     }
 }
 
-void ImageIndex::deleteDescriptor(BinaryDescriptorPtr q){
-    // Deleting the descriptor from each tree
-    if(init_){
-        #pragma omp parallel for
-        for(unsigned i = 0; i < trees_.size(); i++){
-            trees_[i]->deleteDescriptor(q);
+void ImageIndex::searchDescriptorsBatch(
+                        const std::vector<cv::Mat>& descs,
+                        std::vector<std::vector<std::vector<cv::DMatch> > >* matches,
+                        const unsigned knn,
+                        const unsigned checks){
+
+    // Copying the rows of all the frames into one block, so they go through
+    // the interleaved search, and are grouped by first-level cluster when
+    // queries are reordered, as the rows of one frame
+    std::vector<unsigned> first(descs.size() + 1, 0);
+    unsigned cols = 0;
+    for(unsigned f = 0; f < descs.size(); f++){
+        first[f + 1] = first[f] + descs[f].rows;
+        if(descs[f].rows > 0){
+            cols = descs[f].cols;
         }
     }
 
-    dset_.erase(q);
-    unsigned desc_id = desc_to_id_[q];
-    desc_to_id_.erase(q);
-    id_to_desc_.erase(desc_id);
-    inv_index_.erase(q);
-}
+    std::vector<unsigned char> rows(first.back() * cols);
+    for(unsigned f = 0; f < descs.size(); f++){
+        assert(descs[f].empty() || static_cast<unsigned>(descs[f].cols) == cols);
+        for(int i = 0; i < descs[f].rows; i++){
+            memcpy(&rows[(first[f] + i) * cols], descs[f].ptr<unsigned char>(i), cols);
+        }
+    }
 
-void ImageIndex::getMatchings(
-      const std::vector<cv::KeyPoint>& query_kps,
-      const std::vector<cv::DMatch>& matches,
-      std::unordered_map<unsigned, PointMatches>* point_matches){
-    for(unsigned i = 0; i < matches.size(); i++){
-        // Getting the query point
-        int qid = matches[i].queryIdx;
-        cv::Point2f qpoint = query_kps[qid].pt;
+    std::vector<std::vector<cv::DMatch> > all;
+    searchDescriptors(DescriptorView(rows.data(), first.back(), cols, cols),
+                      &all, knn, checks);
 
-        // Processing the train points
-        int tid = matches[i].trainIdx;
-        BinaryDescriptorPtr desc_ptr = id_to_desc_[static_cast<unsigned>(tid)];
-        for(unsigned j = 0; j < inv_index_[desc_ptr].size(); j++){
-            InvIndexItem item = inv_index_[desc_ptr][j];
-            unsigned im_id = item.image_id;
-            cv::Point2f tpoint = item.pt;
+    // Splitting the results by frame
+    matches->resize(descs.size());
+    for(unsigned f = 0; f < descs.size(); f++){
 
-            (*point_matches)[im_id].query.push_back(qpoint);
-            (*point_matches)[im_id].train.push_back(tpoint);
+        (*matches)[f].resize(descs[f].rows);
+        for(int i = 0; i < descs[f].rows; i++){
+
+            std::vector<cv::DMatch>& m = (*matches)[f][i];
+            m.swap(all[first[f] + i]);
+            for(unsigned j = 0; j < m.size(); j++){
+                m[j].queryIdx = i;
+            }
         }
     }
 }
 
-void ImageIndex::purgeDescriptors(const unsigned curr_img){
-    
-    auto it = recently_added_.begin();
-
-    while(it != recently_added_.end()){
-        BinaryDescriptorPtr desc = *it;
-        // We assess if at least three images have passed since creation
-        if((curr_img - inv_index_[desc][0].image_id) > 1){
-            
-            // If so, we assess if the feature has been seen at least twice
-        
-            if(inv_index_[desc].size() < min_feat_apps_){
-                deleteDescriptor(desc);
+void ImageIndex::hintWords(const std::vector<int>& hints,
+                           std::vector<BinaryDescriptorPtr>* words) const {
+
+    // Words deleted since the hints were taken are ignored
+    words->clear();
+    for(unsigned i = 0; i < hints.size(); i++){
+        BinaryDescriptorPtr hint;
+        if(hints[i] >= 0){
+            auto it = id_to_desc_.find(hints[i]);
+            if(it != id_to_desc_.end()){
+                hint = it->second;
             }
-
-            it = recently_added_.erase(it);
         }
-        else{
-            // This descriptor should be maintained in the list
-            it++;
+        words->push_back(hint);
+    }
+}
+
+void ImageIndex::reorderQueries(const DescriptorView& descs,
+                                std::vector<unsigned>* order,
+                                std::vector<unsigned char>* rows) const {
+
+    // Cluster of each row: the child of the root of tree 0 it descends to,
+    // one distance per child as in the first step of the search
+    const BinaryTree& tree = *trees_[0];
+    const BinaryTreeNode* root = tree.getRoot().get();
+    unsigned nclusters = root->isLeaf() ? 1 : std::max(root->childNodeSize(), 1u);
+    std::vector<unsigned> cluster(descs.rows, 0);
+
+    if(nclusters > 1){
+        #pragma omp parallel
+        {
+            std::vector<int> dists(tree.branchingFactor());
+
+            #pragma omp for schedule(static)
+            for(int i = 0; i < static_cast<int>(descs.rows); i++){
+                cluster[i] = tree.closestChild(root, descs.row(i), dists.data());
+            }
         }
     }
+
+    // Counting sort, the rows of a cluster keep their order
+    std::vector<unsigned> offset(nclusters + 1, 0);
+    for(unsigned i = 0; i < descs.rows; i++){
+        offset[cluster[i] + 1]++;
+    }
+    for(unsigned c = 0; c < nclusters; c++){
+        offset[c + 1] += offset[c];
+    }
+
+    order->resize(descs.rows);
+    for(unsigned i = 0; i < descs.rows; i++){
+        (*order)[offset[cluster[i]]++] = i;
+    }
+
+    rows->resize(static_cast<size_t>(descs.rows) * descs.cols);
+    for(unsigned i = 0; i < descs.rows; i++){
+        memcpy(&(*rows)[static_cast<size_t>(i) * descs.cols],
+               descs.row((*order)[i]), descs.cols);
+    }
+}
+
+void ImageIndex::permuteHints(const std::vector<unsigned>& order,
+                              std::vector<BinaryDescriptorPtr>* words) const {
+
+    if(words->empty()){
+        return;
+    }
+
+    std::vector<BinaryDescriptorPtr> permuted(order.size());
+    for(unsigned i = 0; i < order.size(); i++){
+        permuted[i] = (*words)[order[i]];
+    }
+    words->swap(permuted);
+}
+
+void ImageIndex::translateMatches(const unsigned query_idx,
+                                  const std::vector<BinaryDescriptorPtr>& neighs,
+                                  const std::vector<HammingDist>& dists,
+                                  std::vector<cv::DMatch>* des_match) const {
+
+    des_match->clear();
+    for(unsigned j = 0; j < neighs.size(); j++){
+        cv::DMatch match;
+        match.queryIdx = query_idx;
+        match.trainIdx = static_cast<int>(desc_to_id_.at(neighs[j]));
+        match.imgIdx = static_cast<int>(inv_index_.at(neighs[j])[0].image_id);
+        match.distance = dists[j];
+        des_match->push_back(match);
+    }
+}
+
+void ImageIndex::deleteDescriptor(const unsigned desc_id){
+
+    // The word may have been purged or evicted already
+    auto it = id_to_desc_.find(desc_id);
+    if(it == id_to_desc_.end()){
+        return;
+    }
+
+    // Clearing the descriptor
+    deleteDescriptor(it->second);
+}
+
+void ImageIndex::searchDescriptor(const BinaryDescriptor& q,                // input  query describtor
+                                  std::vector<BinaryDescriptorPtr>* neigh,  // output neighbour decrib
+                                  std::vector<HammingDist>* distances,      // output distance
+                                  unsigned knn,
+                                  unsigned checks,
+                                  BinaryDescriptorPtr hint){
+    
+    unsigned points_searched = 0;
+    
+    // One queue with the pending branches of all the trees
+    NodePriorityQueue pq;
+    DescriptorQueue r;
+    BinaryDescriptorSet checked;
+
+    // Distances of the best knn points found so far, the k-th on top
+    std::priority_queue<HammingDist> best;
+
+    // The leaf of the hinted word is scanned in the first tree that accepts
+    // the hint, the hinted leaves of the other accepting trees are only
+    // queued, so the tight bound can stop the search before them. The path
+    // of every hinted leaf is queued as a descent would
+    std::vector<bool> hinted(trees_.size(), false);
+    bool seeded = false;
+    if(hint){
+        for(unsigned i = 0; i < trees_.size(); i++){
+
+            BinaryTreeNodePtr leaf = trees_[i]->getLeaf(hint);
+            if(!leaf){
+                continue;
+            }
+
+            unsigned first = r.size();
+            unsigned nchecked = 0;
+            if(trees_[i]->traverseFromLeaf(q, leaf, !seeded,
+                                           &pq, &r, &checked, &nchecked)){
+                points_searched += nchecked;
+                updateBestDistances(r, first, knn, &best);
+                hinted[i] = true;
+                seeded = true;
+            }
+        }
+    }
+
+    // The other trees are descended once, as the initial guess
+    for(unsigned i = 0; i < trees_.size(); i++){
+        if(!hinted[i]){
+            unsigned first = r.size();
+            points_searched += trees_[i]->traverseFromRoot(q, &pq, &r, &checked);
+            updateBestDistances(r, first, knn, &best);
+        }
+    }
+
+    // Best-first search across the trees, until the closest pending node is
+    // too far to improve the k-th neighbour or enough points were checked
+    while(points_searched < checks && !pq.empty()){
+
+        NodeQueueItem n = pq.top();
+        if(best.size() == knn && n.dist > (1.0 + search_epsilon_) * best.top()){
+            break;
+        }
+        pq.pop();
+
+        unsigned first = r.size();
+        points_searched += trees_[n.tree_id]->traverseFromNode(q, n.node,
+                                                               &pq, &r, &checked);
+        updateBestDistances(r, first, knn, &best);
+    }
+
+    r.sort();
+
+    // Returning the required number of descriptors descriptors
+    neigh->clear();
+    distances->clear();
+    unsigned ndescs = std::min(knn, r.size());
+    
+    for(unsigned i = 0; i < ndescs; i++){
+        const DescriptorQueueItem& d = r.get(i);
+
+        neigh->push_back(*d.desc);
+        distances->push_back(d.dist);
+    }
+
+}
+
+void ImageIndex::insertDescriptors(const std::vector<BinaryDescriptorPtr>& descs){
+    
+    for(unsigned i = 0; i < descs.size(); i++){
+
+        BinaryDescriptorPtr q = descs[i];
+
+        // 插入到unordered_set中
+        dset_.insert(q);
+
+        desc_to_id_[q] = ndesc_;
+        id_to_desc_[ndesc_] = q;
+        ndesc_++;
+
+        // 加入到当前图像的桶中, 做进一步的筛选
+        if(purge_descriptors_){
+            purge_buckets_.back().words.push_back(q);
+        }
+
+        // A new word counts as recently matched
+        touchDescriptor(q);
+    }
+
+    // Indexing the descriptors inside each tree. The batch is spread over
+    // all threads by leaf, so the insertion does not stop scaling at one
+    // thread per tree
+    if(init_ && !descs.empty()){
+        for(unsigned i = 0; i < trees_.size(); i++){
+            trees_[i]->addDescriptors(descs);
+        }
+    }
+}
+
+void ImageIndex::deleteDescriptor(BinaryDescriptorPtr q){
+    deleteDescriptors(std::vector<BinaryDescriptorPtr>(1, q));
+}
+
+void ImageIndex::deleteDescriptors(const std::vector<BinaryDescriptorPtr>& descs,
+                                   const bool logged){
+
+    if(descs.empty()){
+        return;
+    }
+
+    // Evictions and explicit deletions are replayed from these records
+    if(logged && log_ && !replaying_){
+        for(unsigned i = 0; i < descs.size(); i++){
+            log_->appendDeleteDescriptor(desc_to_id_[descs[i]]);
+        }
+    }
+
+    // Deleting the descriptors from each tree, one tree per thread
+    if(init_){
+        #pragma omp parallel for
+        for(unsigned i = 0; i < trees_.size(); i++){
+            for(unsigned j = 0; j < descs.size(); j++){
+                trees_[i]->deleteDescriptor(descs[j]);
+            }
+        }
+    }
+
+    for(unsigned i = 0; i < descs.size(); i++){
+
+        BinaryDescriptorPtr q = descs[i];
+
+        dset_.erase(q);
+        unsigned desc_id = desc_to_id_[q];
+        desc_to_id_.erase(q);
+        id_to_desc_.erase(desc_id);
+
+        auto inv_it = inv_index_.find(q);
+        if(inv_it != inv_index_.end()){
+            nposts_ -= inv_it->second.size();
+            inv_index_.erase(inv_it);
+        }
+
+        auto lru_it = lru_pos_.find(q);
+        if(lru_it != lru_pos_.end()){
+            lru_.erase(lru_it->second);
+            lru_pos_.erase(lru_it);
+        }
+    }
+}
+
+void ImageIndex::getMatchings(
+      const std::vector<cv::KeyPoint>& query_kps,
+      const std::vector<cv::DMatch>& matches,
+      std::unordered_map<unsigned, PointMatches>* point_matches){
+    for(unsigned i = 0; i < matches.size(); i++){
+        // Getting the query point
+        int qid = matches[i].queryIdx;
+        cv::Point2f qpoint = query_kps[qid].pt;
+
+        // Processing the train points
+        int tid = matches[i].trainIdx;
+        BinaryDescriptorPtr desc_ptr = id_to_desc_[static_cast<unsigned>(tid)];
+        for(unsigned j = 0; j < inv_index_[desc_ptr].size(); j++){
+            InvIndexItem item = inv_index_[desc_ptr][j];
+            unsigned im_id = item.image_id;
+            cv::Point2f tpoint = item.pt;
+
+            (*point_matches)[im_id].query.push_back(qpoint);
+            (*point_matches)[im_id].train.push_back(tpoint);
+        }
+    }
+}
+
+bool ImageIndex::removeImage(const unsigned image_id){
+
+    if(image_id < first_image_ || image_id >= nimages_ ||
+       removed_images_.count(image_id)){
+        return false;
+    }
+
+    // Logging the update before applying it
+    if(log_ && !replaying_){
+        log_->appendRemoveImage(image_id);
+    }
+
+    // Stripping the postings of the image. The words left without postings
+    // are deleted from the trees in one batch.
+    std::vector<BinaryDescriptorPtr> orphans;
+
+    auto words_it = image_words_.find(image_id);
+    if(words_it != image_words_.end()){
+
+        const std::vector<unsigned>& ids = words_it->second;
+        for(unsigned i = 0; i < ids.size(); i++){
+
+            // The word may have been purged or evicted already
+            auto it = id_to_desc_.find(ids[i]);
+            if(it == id_to_desc_.end()){
+                continue;
+            }
+
+            std::vector<InvIndexItem>& posts = inv_index_.at(it->second);
+            unsigned nposts = posts.size();
+            posts.erase(std::remove_if(posts.begin(), posts.end(),
+                                       [image_id](const InvIndexItem& item){
+                                           return item.image_id == image_id;
+                                       }),
+                        posts.end());
+            nposts_ -= nposts - posts.size();
+
+            // A word may be listed once per keypoint of the image
+            if(posts.empty() && nposts > 0){
+                orphans.push_back(it->second);
+            }
+        }
+
+        image_words_.erase(words_it);
+    }
+
+    // Replayed with the removal of the image
+    deleteDescriptors(orphans, false);
+    direct_index_.erase(image_id);
+
+    // The oldest images removed are only counted by first_image_
+    removed_images_.insert(image_id);
+    while(first_image_ < nimages_ && removed_images_.erase(first_image_)){
+        first_image_++;
+    }
+
+    return true;
+}
+
+void ImageIndex::setImageWindow(const unsigned window){
+    image_window_ = window;
+    retireImages();
+}
+
+void ImageIndex::retireImages(){
+
+    if(image_window_ == 0){
+        return;
+    }
+
+    // The first image is never a removed one
+    while(numActiveImages() > image_window_){
+        removeImage(first_image_);
+    }
+}
+
+void ImageIndex::enableDirectIndex(const unsigned level){
+
+    direct_index_enabled_ = true;
+
+    // The images already kept are grouped again at the new level
+    if(level != direct_level_){
+        direct_level_ = level;
+        for(auto it = direct_index_.begin(); it != direct_index_.end(); it++){
+            it->second.version = 0;
+            it->second.nodes.clear();
+        }
+    }
+}
+
+void ImageIndex::addToDirectIndex(const unsigned image_id,
+                                  const std::vector<cv::KeyPoint>& kps,
+                                  const cv::Mat& descs){
+
+    DirectIndexEntry& entry = direct_index_[image_id];
+    entry = DirectIndexEntry();
+
+    entry.descs.resize(descs.rows * desc_bytes_);
+    entry.pts.resize(descs.rows);
+    for(int i = 0; i < descs.rows; i++){
+        memcpy(&entry.descs[i * desc_bytes_], descs.ptr<unsigned char>(i),
+               desc_bytes_);
+        entry.pts[i] = kps[i].pt;
+    }
+
+    groupDirectEntry(&entry);
+}
+
+void ImageIndex::groupDirectEntry(DirectIndexEntry* entry) const {
+
+    // Before the trees are built every keypoint shares the same group
+    uint64_t version = init_ ? trees_[0]->version() : 0;
+    if(entry->version == version && version != 0){
+        return;
+    }
+
+    entry->nodes.clear();
+
+    std::vector<int> dists(k_);
+    for(unsigned i = 0; i < entry->pts.size(); i++){
+        const BinaryTreeNode* n = nullptr;
+        if(init_){
+            n = trees_[0]->descendToLevel(&entry->descs[i * desc_bytes_],
+                                          direct_level_, dists.data());
+        }
+        entry->nodes[n].push_back(i);
+    }
+
+    entry->version = version;
+}
+
+bool ImageIndex::matchImages(const unsigned image_a,
+                             const unsigned image_b,
+                             std::vector<cv::DMatch>* matches,
+                             const double ratio,
+                             const double max_dist){
+
+    matches->clear();
+
+    auto it_a = direct_index_.find(image_a);
+    auto it_b = direct_index_.find(image_b);
+    if(it_a == direct_index_.end() || it_b == direct_index_.end()){
+        return false;
+    }
+
+    DirectIndexEntry& a = it_a->second;
+    DirectIndexEntry& b = it_b->second;
+    groupDirectEntry(&a);
+    groupDirectEntry(&b);
+
+    for(auto it = a.nodes.begin(); it != a.nodes.end(); it++){
+
+        auto jt = b.nodes.find(it->first);
+        if(jt == b.nodes.end()){
+            continue;
+        }
+
+        const std::vector<int>& kps_a = it->second;
+        const std::vector<int>& kps_b = jt->second;
+
+        for(unsigned i = 0; i < kps_a.size(); i++){
+
+            const unsigned char* q = &a.descs[kps_a[i] * desc_bytes_];
+            int best = -1;
+            int best_dist = std::numeric_limits<int>::max();
+            int second_dist = std::numeric_limits<int>::max();
+
+            for(unsigned j = 0; j < kps_b.size(); j++){
+                int dist = hamming(q, &b.descs[kps_b[j] * desc_bytes_],
+                                   desc_bytes_);
+                if(dist < best_dist){
+                    second_dist = best_dist;
+                    best_dist = dist;
+                    best = kps_b[j];
+                }
+                else if(dist < second_dist){
+                    second_dist = dist;
+                }
+            }
+
+            // A single candidate has nothing to be compared with
+            if(best != -1 && best_dist <= max_dist &&
+               (second_dist == std::numeric_limits<int>::max() ||
+                best_dist < ratio * second_dist)){
+                matches->push_back(cv::DMatch(kps_a[i], best, best_dist));
+            }
+        }
+    }
+
+    // The groups are visited in no particular order
+    std::sort(matches->begin(), matches->end(),
+              [](const cv::DMatch& x, const cv::DMatch& y){
+                  return x.queryIdx < y.queryIdx;
+              });
+
+    return true;
+}
+
+bool ImageIndex::matchImages(const unsigned image_a,
+                             const unsigned image_b,
+                             PointMatches* point_matches,
+                             const double ratio,
+                             const double max_dist){
+
+    std::vector<cv::DMatch> matches;
+    if(!matchImages(image_a, image_b, &matches, ratio, max_dist)){
+        return false;
+    }
+
+    const DirectIndexEntry& a = direct_index_[image_a];
+    const DirectIndexEntry& b = direct_index_[image_b];
+    for(unsigned i = 0; i < matches.size(); i++){
+        point_matches->query.push_back(a.pts[matches[i].queryIdx]);
+        point_matches->train.push_back(b.pts[matches[i].trainIdx]);
+    }
+
+    return true;
+}
+
+void ImageIndex::purgeDescriptors(const unsigned curr_img){
+
+    std::vector<BinaryDescriptorPtr> unstable;
+
+    // Only the buckets of images at least two images old are examined, so
+    // the cost depends on the words created by those images
+    auto bucket = purge_buckets_.begin();
+    while(bucket != purge_buckets_.end()){
+
+        if((curr_img - bucket->image_id) <= 1){
+            bucket++;
+            continue;
+        }
+
+        for(unsigned i = 0; i < bucket->words.size(); i++){
+
+            // The descriptor may have been evicted or deleted in the meantime
+            auto inv_it = inv_index_.find(bucket->words[i]);
+            if(inv_it == inv_index_.end()){
+                continue;
+            }
+
+            // The feature should have been seen at least min_feat_apps_ times
+            if(inv_it->second.size() < min_feat_apps_){
+                unstable.push_back(bucket->words[i]);
+            }
+        }
+
+        bucket = purge_buckets_.erase(bucket);
+    }
+
+    // Replayed with the images
+    deleteDescriptors(unstable, false);
+}
+
+void ImageIndex::setInsertRadius(const unsigned radius){
+    assert(radius < std::numeric_limits<HammingDist>::max());
+    insert_radius_ = radius;
+}
+
+unsigned ImageIndex::matchNearDuplicates(const cv::Mat& descs,
+                                         std::vector<cv::DMatch>* matches) const {
+
+    std::vector<bool> matched(descs.rows, false);
+    for(unsigned i = 0; i < matches->size(); i++){
+        matched[(*matches)[i].queryIdx] = true;
+    }
+
+    std::vector<int> rows;
+    for(int i = 0; i < descs.rows; i++){
+        if(!matched[i]){
+            rows.push_back(i);
+        }
+    }
+
+    // Only the leaves the rows would be inserted in are checked, so the
+    // filter costs one descent per tree
+    std::vector<BinaryDescriptorPtr> dups(rows.size());
+    std::vector<HammingDist> dup_dists(rows.size());
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(int i = 0; i < static_cast<int>(rows.size()); i++){
+
+        BinaryDescriptor q(descs.ptr<unsigned char>(rows[i]), desc_bytes_, false);
+        HammingDist best_dist = insert_radius_ + 1;
+
+        for(unsigned t = 0; t < trees_.size(); t++){
+
+            BinaryTreeNodePtr leaf = trees_[t]->searchFromRoot(q);
+            BinaryDescriptorSet* words = leaf->getChildrenDescriptors();
+
+            for(auto it = words->begin(); it != words->end(); it++){
+                HammingDist dist = BinaryDescriptor::distHamming(q, **it);
+                if(dist < best_dist){
+                    best_dist = dist;
+                    dups[i] = *it;
+                }
+            }
+        }
+
+        dup_dists[i] = best_dist;
+    }
+
+    unsigned nmatched = 0;
+    for(unsigned i = 0; i < rows.size(); i++){
+        if(dups[i]){
+            cv::DMatch match;
+            match.queryIdx = rows[i];
+            match.trainIdx = static_cast<int>(desc_to_id_.at(dups[i]));
+            match.imgIdx = static_cast<int>(inv_index_.at(dups[i])[0].image_id);
+            match.distance = dup_dists[i];
+            matches->push_back(match);
+            nmatched++;
+        }
+    }
+
+    return nmatched;
+}
+
+void ImageIndex::setQueryReordering(const bool reorder){
+    reorder_queries_ = reorder;
+}
+
+void ImageIndex::setBuildSample(const unsigned sample){
+    assert(sample == 0 || sample >= k_);
+    build_sample_ = sample;
+}
+
+void ImageIndex::setSearchEpsilon(const double epsilon){
+    assert(epsilon >= 0.0);
+    search_epsilon_ = epsilon;
+}
+
+void ImageIndex::setMemoryBudget(const size_t max_bytes,
+                                 const unsigned max_words,
+                                 const unsigned max_evictions){
+    max_bytes_ = max_bytes;
+    max_words_ = max_words;
+    max_evictions_ = max_evictions;
+}
+
+unsigned ImageIndex::numNodes() const {
+
+    unsigned nnodes = 0;
+    for(unsigned i = 0; i < trees_.size(); i++){
+        nnodes += trees_[i]->numNodes();
+    }
+
+    return nnodes;
+}
+
+unsigned ImageIndex::numDegradedNodes() const {
+
+    unsigned ndegraded = 0;
+    for(unsigned i = 0; i < trees_.size(); i++){
+        ndegraded += trees_[i]->numDegradedNodes();
+    }
+
+    return ndegraded;
+}
+
+MemoryUsage ImageIndex::memoryUsage() const {
+
+    // Hash containers store each element in a node with a next pointer and
+    // the cached hash, plus one bucket pointer per element on average
+    const size_t hash_entry = 3 * sizeof(void*);
+    const size_t nwords = dset_.size();
+
+    MemoryUsage usage;
+
+    // Descriptor objects, their bits, shared_ptr control blocks and dset_
+    usage.descriptors = nwords * (sizeof(BinaryDescriptor) + desc_bytes_ +
+                                  2 * sizeof(void*) +
+                                  sizeof(BinaryDescriptorPtr) + hash_entry);
+
+    for(unsigned i = 0; i < trees_.size(); i++){
+        usage.trees += trees_[i]->memoryUsage();
+    }
+
+    usage.inv_index = nposts_ * sizeof(InvIndexItem) +
+                      inv_index_.size() * (sizeof(BinaryDescriptorPtr) +
+                                           sizeof(std::vector<InvIndexItem>) +
+                                           hash_entry);
+
+    // Words of each image, one entry per posting
+    for(auto it = image_words_.begin(); it != image_words_.end(); it++){
+        usage.inv_index += sizeof(unsigned) + sizeof(std::vector<unsigned>) +
+                           hash_entry + it->second.capacity() * sizeof(unsigned);
+    }
+
+    // desc_to_id_, id_to_desc_, the LRU list and its position map
+    usage.id_maps = desc_to_id_.size() * (sizeof(BinaryDescriptorPtr) +
+                                          sizeof(unsigned) + hash_entry) +
+                    id_to_desc_.size() * (sizeof(unsigned) +
+                                          sizeof(BinaryDescriptorPtr) + hash_entry) +
+                    lru_.size() * (sizeof(BinaryDescriptorPtr) + 2 * sizeof(void*)) +
+                    lru_pos_.size() * (sizeof(BinaryDescriptorPtr) +
+                                       sizeof(void*) + hash_entry);
+
+    // Descriptors, points and node groups of each image
+    for(auto it = direct_index_.begin(); it != direct_index_.end(); it++){
+        const DirectIndexEntry& e = it->second;
+        usage.direct_index += sizeof(unsigned) + sizeof(DirectIndexEntry) +
+                              hash_entry + e.descs.capacity() +
+                              e.pts.capacity() * sizeof(cv::Point2f) +
+                              e.pts.size() * sizeof(int) +
+                              e.nodes.size() * (sizeof(void*) +
+                                                sizeof(std::vector<int>) +
+                                                hash_entry);
+    }
+
+    return usage;
+}
+
+void ImageIndex::touchDescriptor(BinaryDescriptorPtr q){
+
+    auto it = lru_pos_.find(q);
+    if(it != lru_pos_.end()){
+        lru_.splice(lru_.end(), lru_, it->second);
+    }
+    else{
+        lru_.push_back(q);
+        lru_pos_[q] = std::prev(lru_.end());
+    }
+}
+
+void ImageIndex::evictDescriptors(){
+
+    // Evictions depend on the shape of the trees, the log replays them as
+    // explicit deletions
+    if(!init_ || replaying_ || (max_bytes_ == 0 && max_words_ == 0)){
+        return;
+    }
+
+    unsigned nwords = dset_.size();
+    unsigned nevict = 0;
+
+    // Words over the word budget
+    if(max_words_ > 0 && nwords > max_words_){
+        nevict = nwords - max_words_;
+    }
+
+    // Words over the memory budget, assuming every word costs the average.
+    // The direct index grows with the images, evicting words does not
+    // reduce it
+    if(max_bytes_ > 0 && nwords > 0){
+        MemoryUsage usage = memoryUsage();
+        size_t used = usage.total() - usage.direct_index;
+        if(used > max_bytes_){
+            size_t word_bytes = std::max<size_t>(used / nwords, 1);
+            size_t excess = (used - max_bytes_ + word_bytes - 1) / word_bytes;
+            nevict = std::max<unsigned>(nevict,
+                                        std::min<size_t>(excess, nwords));
+        }
+    }
+
+    // Spreading large evictions over several images
+    nevict = std::min(nevict, max_evictions_);
+
+    std::vector<BinaryDescriptorPtr> victims;
+    for(auto it = lru_.begin(); it != lru_.end() && victims.size() < nevict; it++){
+        victims.push_back(*it);
+    }
+
+    deleteDescriptors(victims);
+}
+
+FrozenIndexPtr ImageIndex::freeze() const {
+    return std::make_shared<FrozenIndex>(*this);
+}
+
+bool ImageIndex::merge(const ImageIndex& other,
+                       const unsigned image_id_offset,
+                       const unsigned dedup_radius){
+
+    assert(&other != this);
+    assert(image_id_offset >= nimages_);
+
+    // The pending records must be durable before the checkpoint that
+    // follows the merge folds them in
+    if(log_ && !log_->commit()){
+        return false;
+    }
+
+    if(other.desc_bytes_ > 0){
+        checkDescriptorWidth(other.desc_bytes_);
+    }
+
+    // The words of the other index keep their relative order of ids
+    std::vector<unsigned> ids;
+    ids.reserve(other.id_to_desc_.size());
+    for(auto it = other.id_to_desc_.begin(); it != other.id_to_desc_.end(); it++){
+        ids.push_back(it->first);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    // Looking for the duplicates among the words of this index only, before
+    // anything changes, so the searches can run in parallel
+    std::vector<BinaryDescriptorPtr> dups(ids.size());
+    if(dedup_radius > 0 && init_){
+
+        #pragma omp parallel for schedule(dynamic, 256)
+        for(int i = 0; i < static_cast<int>(ids.size()); i++){
+
+            const BinaryDescriptorPtr& d = other.id_to_desc_.at(ids[i]);
+            std::vector<BinaryDescriptorPtr> neigh;
+            std::vector<HammingDist> dists;
+            searchDescriptor(*d, &neigh, &dists, 1, kMergeChecks);
+
+            if(!neigh.empty() && dists[0] <= dedup_radius){
+                dups[i] = neigh[0];
+            }
+        }
+    }
+
+    // Word of this index receiving each imported word
+    std::unordered_map<BinaryDescriptorPtr, BinaryDescriptorPtr> imported;
+
+    for(unsigned i = 0; i < ids.size(); i++){
+
+        const BinaryDescriptorPtr& src = other.id_to_desc_.at(ids[i]);
+        BinaryDescriptorPtr d = dups[i];
+
+        if(d){
+            // Updated as a matched word
+            if(merge_policy_ == MERGE_POLICY_AND){
+                *d &= *src;
+            }
+            else if(merge_policy_ == MERGE_POLICY_OR){
+                *d |= *src;
+            }
+        }
+        else{
+            d = std::make_shared<BinaryDescriptor>(src->bits_, desc_bytes_);
+            dset_.insert(d);
+            desc_to_id_[d] = ndesc_;
+            id_to_desc_[ndesc_] = d;
+            ndesc_++;
+        }
+
+        const std::vector<InvIndexItem>& src_posts = other.inv_index_.at(src);
+        std::vector<InvIndexItem>& posts = inv_index_[d];
+        unsigned desc_id = desc_to_id_.at(d);
+        for(unsigned j = 0; j < src_posts.size(); j++){
+            posts.push_back(src_posts[j]);
+            posts.back().image_id += image_id_offset;
+            image_words_[posts.back().image_id].push_back(desc_id);
+        }
+        nposts_ += src_posts.size();
+
+        imported[src] = d;
+    }
+
+    // The imported words are the most recently matched, in their order
+    for(auto it = other.lru_.begin(); it != other.lru_.end(); it++){
+        touchDescriptor(imported.at(*it));
+    }
+
+    // The groups are computed again with the new trees
+    for(auto it = other.direct_index_.begin(); it != other.direct_index_.end(); it++){
+        DirectIndexEntry& e = direct_index_[it->first + image_id_offset];
+        e.descs = it->second.descs;
+        e.pts = it->second.pts;
+        e.version = 0;
+        e.nodes.clear();
+    }
+
+    // The ids skipped before the offset and the images removed from the
+    // other index count as removed images
+    unsigned other_first = image_id_offset + other.first_image_;
+    if(numActiveImages() == 0){
+        removed_images_.clear();
+        first_image_ = other_first;
+    }
+    else{
+        for(unsigned i = nimages_; i < other_first; i++){
+            removed_images_.insert(i);
+        }
+    }
+    for(auto it = other.removed_images_.begin(); it != other.removed_images_.end(); it++){
+        removed_images_.insert(*it + image_id_offset);
+    }
+    nimages_ = image_id_offset + other.nimages_;
+
+    // Building the trees once with all the words
+    if(init_ || other.init_){
+        init_ = true;
+        rebuild();
+    }
+
+    // The log could not be replayed past the merge, which is not logged. A
+    // crash before the checkpoint recovers the index before the merge
+    return log_ ? checkpoint(snapshot_path_) : true;
+}
+
+bool ImageIndex::save(const std::string& filename) const {
+    return saveSnapshot(filename, log_ ? log_->lastLsn() : 0);
+}
+
+bool ImageIndex::load(const std::string& filename){
+    uint64_t lsn;
+    return loadSnapshot(filename, &lsn);
+}
+
+bool ImageIndex::enableLog(const std::string& log_path,
+                           const std::string& snapshot_path,
+                           const unsigned group_records){
+
+    // The new log starts empty, the index so far is in the snapshot. A crash
+    // before the checkpoint recovers the previous snapshot, if any
+    log_ = std::make_shared<IndexLog>(log_path, 1, 0, group_records);
+    if(!checkpoint(snapshot_path)){
+
+        // A previous snapshot would skip the new records by their sequence
+        // number
+        log_ = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool ImageIndex::syncLog(){
+    return log_ ? log_->commit() : true;
+}
+
+bool ImageIndex::checkpoint(const std::string& snapshot_path){
+
+    uint64_t lsn = 0;
+    if(log_){
+        if(!log_->commit()){
+            return false;
+        }
+        lsn = log_->lastLsn();
+    }
+
+    // Replacing the previous snapshot atomically. The new snapshot is on
+    // disk before the rename, and the rename before the log is emptied
+    std::string tmp_path = snapshot_path + ".tmp";
+    if(!saveSnapshot(tmp_path, lsn) ||
+       rename(tmp_path.c_str(), snapshot_path.c_str()) != 0 ||
+       !syncParentDirectory(snapshot_path)){
+        return false;
+    }
+
+    snapshot_path_ = snapshot_path;
+
+    // A crash before this point replays records already in the snapshot,
+    // which are skipped by their sequence number
+    return log_ ? log_->truncate() : true;
+}
+
+bool ImageIndex::recover(const std::string& snapshot_path,
+                         const std::string& log_path,
+                         const unsigned group_records){
+
+    uint64_t lsn = 0;
+    std::ifstream snapshot(snapshot_path.c_str(), std::ios::binary);
+    if(snapshot.good()){
+        snapshot.close();
+        if(!loadSnapshot(snapshot_path, &lsn)){
+            return false;
+        }
+    }
+
+    // Replaying the tail of the log
+    log_ = nullptr;
+    replaying_ = true;
+
+    IndexLogReader reader(log_path);
+    LogRecord record;
+    uint64_t last_lsn = lsn;
+    while(reader.next(&record)){
+        if(record.lsn <= lsn){
+            continue;
+        }
+        applyLogRecord(record);
+        last_lsn = record.lsn;
+    }
+
+    replaying_ = false;
+
+    // Appending after the last valid record
+    log_ = std::make_shared<IndexLog>(log_path, last_lsn + 1,
+                                      reader.validBytes(), group_records);
+    snapshot_path_ = snapshot_path;
+
+    return true;
+}
+
+void ImageIndex::applyLogRecord(const LogRecord& record){
+
+    std::istringstream in(record.payload);
+    ByteReader reader(&in);
+
+    switch(record.type){
+
+        case LOG_RECORD_ADD_IMAGE:
+        case LOG_RECORD_ADD_IMAGE_MATCHES:{
+            unsigned image_id = reader.get<uint32_t>();
+            std::vector<cv::KeyPoint> kps;
+            reader.getKeyPoints(&kps);
+            cv::Mat descs = reader.getMat();
+
+            if(record.type == LOG_RECORD_ADD_IMAGE){
+                addImage(image_id, kps, descs);
+            }
+            else{
+                std::vector<cv::DMatch> matches;
+                reader.getMatches(&matches);
+                addImage(image_id, kps, descs, matches);
+            }
+            break;
+        }
+
+        case LOG_RECORD_DELETE_DESCRIPTOR:{
+            // Ignored if the word is already gone
+            unsigned desc_id = reader.get<uint32_t>();
+            auto it = id_to_desc_.find(desc_id);
+            if(it != id_to_desc_.end()){
+                deleteDescriptor(it->second);
+            }
+            break;
+        }
+
+        case LOG_RECORD_REMOVE_IMAGE:
+            // Images retired by the window while replaying are already gone
+            removeImage(reader.get<uint32_t>());
+            break;
+
+        default:
+            assert(false);
+    }
+}
+
+bool ImageIndex::saveSnapshot(const std::string& filename,
+                              const uint64_t lsn) const {
+
+    std::ofstream out(filename.c_str(), std::ios::binary | std::ios::trunc);
+    if(!out.good()){
+        return false;
+    }
+
+    ByteWriter writer(&out);
+
+    // Header
+    writer.put<uint32_t>(kSnapshotMagic);
+    writer.put<uint32_t>(kSnapshotVersion);
+    writer.put<uint64_t>(lsn);
+
+    // Parameters
+    writer.put<uint32_t>(k_);
+    writer.put<uint32_t>(s_);
+    writer.put<uint32_t>(t_);
+    writer.put<uint32_t>(merge_policy_);
+    writer.put<uint8_t>(purge_descriptors_);
+    writer.put<uint32_t>(min_feat_apps_);
+
+    // State
+    writer.put<uint8_t>(init_);
+    writer.put<uint32_t>(nimages_);
+    writer.put<uint32_t>(ndesc_);
+    writer.put<uint32_t>(desc_bytes_);
+
+    // Words with their postings, sorted by id
+    std::vector<unsigned> ids;
+    ids.reserve(id_to_desc_.size());
+    for(auto it = id_to_desc_.begin(); it != id_to_desc_.end(); it++){
+        ids.push_back(it->first);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    writer.put<uint32_t>(ids.size());
+    for(unsigned w = 0; w < ids.size(); w++){
+        
+        BinaryDescriptorPtr d = id_to_desc_.at(ids[w]);
+        writer.put<uint32_t>(ids[w]);
+        writer.putBytes(d->bits_, d->size_in_bytes_);
+
+        const std::vector<InvIndexItem>& posts = inv_index_.at(d);
+        writer.put<uint32_t>(posts.size());
+        for(unsigned i = 0; i < posts.size(); i++){
+            writer.put<uint32_t>(posts[i].image_id);
+            writer.put<float>(posts[i].pt.x);
+            writer.put<float>(posts[i].pt.y);
+            writer.put<uint16_t>(posts[i].dist);
+            writer.put<int32_t>(posts[i].kp_ind);
+        }
+    }
+
+    // Words waiting to be purged by creating image, skipping those already
+    // evicted
+    writer.put<uint32_t>(purge_buckets_.size());
+    for(auto it = purge_buckets_.begin(); it != purge_buckets_.end(); it++){
+
+        std::vector<unsigned> recent_ids;
+        for(unsigned i = 0; i < it->words.size(); i++){
+            auto id_it = desc_to_id_.find(it->words[i]);
+            if(id_it != desc_to_id_.end()){
+                recent_ids.push_back(id_it->second);
+            }
+        }
+
+        writer.put<uint32_t>(it->image_id);
+        writer.put<uint32_t>(recent_ids.size());
+        for(unsigned i = 0; i < recent_ids.size(); i++){
+            writer.put<uint32_t>(recent_ids[i]);
+        }
+    }
+
+    // Words from the least to the most recently matched
+    writer.put<uint32_t>(lru_.size());
+    for(auto it = lru_.begin(); it != lru_.end(); it++){
+        writer.put<uint32_t>(desc_to_id_.at(*it));
+    }
+
+    // Direct index, sorted by image. The groups are computed again
+    writer.put<uint8_t>(direct_index_enabled_);
+    writer.put<uint32_t>(direct_level_);
+
+    std::vector<unsigned> images;
+    images.reserve(direct_index_.size());
+    for(auto it = direct_index_.begin(); it != direct_index_.end(); it++){
+        images.push_back(it->first);
+    }
+    std::sort(images.begin(), images.end());
+
+    writer.put<uint32_t>(images.size());
+    for(unsigned i = 0; i < images.size(); i++){
+
+        const DirectIndexEntry& e = direct_index_.at(images[i]);
+        writer.put<uint32_t>(images[i]);
+        writer.put<uint32_t>(e.pts.size());
+        writer.putBytes(e.descs.data(), e.descs.size());
+        for(unsigned j = 0; j < e.pts.size(); j++){
+            writer.put<float>(e.pts[j].x);
+            writer.put<float>(e.pts[j].y);
+        }
+    }
+
+    // Removed images
+    writer.put<uint32_t>(image_window_);
+    writer.put<uint32_t>(first_image_);
+    writer.put<uint32_t>(removed_images_.size());
+    for(auto it = removed_images_.begin(); it != removed_images_.end(); it++){
+        writer.put<uint32_t>(*it);
+    }
+
+    out.close();
+    return writer.good() && syncFile(filename);
+}
+
+bool ImageIndex::loadSnapshot(const std::string& filename, uint64_t* lsn){
+
+    // Reading into a new index, so that a bad or truncated snapshot leaves
+    // this one as it was
+    ImageIndex snapshot;
+    uint64_t snapshot_lsn = 0;
+    if(!snapshot.readSnapshot(filename, &snapshot_lsn)){
+        return false;
+    }
+
+    // Taking the state held by the snapshot. The memory budget, the search
+    // settings and the log of this index are kept
+    k_ = snapshot.k_;
+    s_ = snapshot.s_;
+    t_ = snapshot.t_;
+    merge_policy_ = snapshot.merge_policy_;
+    purge_descriptors_ = snapshot.purge_descriptors_;
+    min_feat_apps_ = snapshot.min_feat_apps_;
+    init_ = snapshot.init_;
+    nimages_ = snapshot.nimages_;
+    ndesc_ = snapshot.ndesc_;
+    desc_bytes_ = snapshot.desc_bytes_;
+    nposts_ = snapshot.nposts_;
+    first_image_ = snapshot.first_image_;
+    image_window_ = snapshot.image_window_;
+    direct_index_enabled_ = snapshot.direct_index_enabled_;
+    direct_level_ = snapshot.direct_level_;
+
+    dset_.swap(snapshot.dset_);
+    inv_index_.swap(snapshot.inv_index_);
+    desc_to_id_.swap(snapshot.desc_to_id_);
+    id_to_desc_.swap(snapshot.id_to_desc_);
+    purge_buckets_.swap(snapshot.purge_buckets_);
+    lru_.swap(snapshot.lru_);
+    lru_pos_.swap(snapshot.lru_pos_);
+    removed_images_.swap(snapshot.removed_images_);
+    image_words_.swap(snapshot.image_words_);
+    direct_index_.swap(snapshot.direct_index_);
+
+    trees_.clear();
+    if(init_){
+        initTrees();
+    }
+
+    *lsn = snapshot_lsn;
+    return true;
+}
+
+bool ImageIndex::readSnapshot(const std::string& filename, uint64_t* lsn){
+
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if(!in.good()){
+        return false;
+    }
+
+    ByteReader reader(&in);
+
+    // Header
+    if(reader.get<uint32_t>() != kSnapshotMagic){
+        return false;
+    }
+
+    if(reader.get<uint32_t>() != kSnapshotVersion){
+        return false;
+    }
+    *lsn = reader.get<uint64_t>();
+
+    // Parameters
+    k_ = reader.get<uint32_t>();
+    s_ = reader.get<uint32_t>();
+    t_ = reader.get<uint32_t>();
+    merge_policy_ = static_cast<MergePolicy>(reader.get<uint32_t>());
+    purge_descriptors_ = reader.get<uint8_t>();
+    min_feat_apps_ = reader.get<uint32_t>();
+
+    // State
+    init_ = reader.get<uint8_t>();
+    nimages_ = reader.get<uint32_t>();
+    ndesc_ = reader.get<uint32_t>();
+    desc_bytes_ = reader.get<uint32_t>();
+
+    // The same parameters the constructor accepts
+    if(!reader.good() || k_ < 2 || k_ >= s_ || min_feat_apps_ == 0){
+        return false;
+    }
+
+    // Words with their postings
+    unsigned nwords = reader.get<uint32_t>();
+    std::vector<unsigned char> bits(desc_bytes_);
+    for(unsigned i = 0; i < nwords && reader.good(); i++){
+
+        unsigned desc_id = reader.get<uint32_t>();
+        reader.getBytes(bits.data(), desc_bytes_);
+        BinaryDescriptorPtr d =
+                    std::make_shared<BinaryDescriptor>(bits.data(), desc_bytes_);
+
+        dset_.insert(d);
+        desc_to_id_[d] = desc_id;
+        id_to_desc_[desc_id] = d;
+
+        std::vector<InvIndexItem>& posts = inv_index_[d];
+        posts.resize(reader.get<uint32_t>());
+        for(unsigned j = 0; j < posts.size() && reader.good(); j++){
+            posts[j].image_id = reader.get<uint32_t>();
+            posts[j].pt.x = reader.get<float>();
+            posts[j].pt.y = reader.get<float>();
+            posts[j].dist = reader.get<uint16_t>();
+            posts[j].kp_ind = reader.get<int32_t>();
+            image_words_[posts[j].image_id].push_back(desc_id);
+        }
+        nposts_ += posts.size();
+    }
+
+    // Words waiting to be purged
+    unsigned nbuckets = reader.get<uint32_t>();
+    for(unsigned i = 0; i < nbuckets && reader.good(); i++){
+
+        purge_buckets_.push_back(PurgeBucket(reader.get<uint32_t>()));
+        PurgeBucket& bucket = purge_buckets_.back();
+
+        unsigned nrecent = reader.get<uint32_t>();
+        for(unsigned j = 0; j < nrecent && reader.good(); j++){
+            auto it = id_to_desc_.find(reader.get<uint32_t>());
+            if(it != id_to_desc_.end()){
+                bucket.words.push_back(it->second);
+            }
+        }
+    }
+
+    // Words from the least to the most recently matched
+    unsigned nlru = reader.get<uint32_t>();
+    for(unsigned i = 0; i < nlru && reader.good(); i++){
+        auto it = id_to_desc_.find(reader.get<uint32_t>());
+        if(it != id_to_desc_.end()){
+            touchDescriptor(it->second);
+        }
+    }
+
+    // Direct index
+    direct_index_enabled_ = reader.get<uint8_t>();
+    direct_level_ = reader.get<uint32_t>();
+
+    unsigned nentries = reader.get<uint32_t>();
+    for(unsigned i = 0; i < nentries && reader.good(); i++){
+
+        DirectIndexEntry& e = direct_index_[reader.get<uint32_t>()];
+        unsigned rows = reader.get<uint32_t>();
+        if(!reader.good()){
+            break;
+        }
+
+        e.descs.resize(rows * desc_bytes_);
+        reader.getBytes(e.descs.data(), e.descs.size());
+        e.pts.resize(rows);
+        for(unsigned j = 0; j < rows; j++){
+            e.pts[j].x = reader.get<float>();
+            e.pts[j].y = reader.get<float>();
+        }
+    }
+
+    // Removed images
+    image_window_ = reader.get<uint32_t>();
+    first_image_ = reader.get<uint32_t>();
+
+    unsigned nremoved = reader.get<uint32_t>();
+    for(unsigned i = 0; i < nremoved && reader.good(); i++){
+        removed_images_.insert(reader.get<uint32_t>());
+    }
+
+    return reader.good();
 }
 
 }  // namespace obindex2
@@ -1,19 +1,82 @@
 #include "binary_tree.h"
 
+#include <atomic>
+
+#include "profiler.h"
+
 namespace obindex2 {
 
+// Versions are drawn from one counter, so a rebuilt tree never reuses one
+static std::atomic<uint64_t> next_tree_version(0);
+
+// Samples per center below which a sampled build stops splitting
+static const unsigned kMinSamplesPerChild = 2;
+
+int nearestChild(const unsigned char* q,
+                 const unsigned char* centers,
+                 const unsigned count,
+                 const unsigned k,
+                 const unsigned nbytes,
+                 int* dists){
+
+    int best = -1;
+    int min_dist = std::numeric_limits<int>::max();
+
+    for(unsigned i = 0; i < count; i++){
+        dists[i] = hamming(q, centers + i * nbytes, nbytes);
+        if(dists[i] < min_dist){
+            min_dist = dists[i];
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+NearestChildFn selectNearestChild(const unsigned k, const unsigned nbytes){
+
+    if(nbytes == 32){
+        switch(k){
+            case 8:
+                return &nearestChildFixed<8, 32>;
+            case 16:
+                return &nearestChildFixed<16, 32>;
+            case 32:
+                return &nearestChildFixed<32, 32>;
+        }
+    }
+    else if(nbytes == 64){
+        switch(k){
+            case 8:
+                return &nearestChildFixed<8, 64>;
+            case 16:
+                return &nearestChildFixed<16, 64>;
+            case 32:
+                return &nearestChildFixed<32, 64>;
+        }
+    }
+
+    return &nearestChild;
+}
+
 BinaryTree::BinaryTree(BinaryDescriptorSetPtr dset,
                        const unsigned tree_id,
                        const unsigned k,
-                       const unsigned s) :
+                       const unsigned s,
+                       const unsigned sample,
+                       const unsigned seed) :
     dset_(dset),
     tree_id_(tree_id),
     root_(nullptr),
     k_(k),
     s_(s),
-    k_2_(k_ / 2)
+    k_2_(k_ / 2),
+    sample_(sample),
+    desc_bytes_(0),
+    nearest_(&nearestChild),
+    version_(0),
+    rng_(seed + tree_id)
 {
-    srand(time(NULL));
     buildTree();
 }
 
@@ -27,35 +90,46 @@ void BinaryTree::buildTree(){
     deleteTree();
 
     degraded_nodes_ = 0;
-    nvisited_nodes_ = 0;
 
     // Creating the root node
     root_ = std::make_shared<BinaryTreeNode>();
     nset_.insert(root_);
 
-    // Generating a new copy set with the descriptor's ids 
-    BinaryDescriptorSet descs = *dset_;
+    // Generating a new copy of the descriptors
+    std::vector<BinaryDescriptorPtr> descs(dset_->begin(), dset_->end());
+    if(!descs.empty()){
+        setDescriptorBytes(descs[0]->size_in_bytes_);
+    }
+    desc_to_node_.reserve(descs.size());
 
-    buildNode(descs, root_);
+    if(sample_ > 0 && descs.size() > sample_){
+        buildSampled(&descs);
+    }
+    else{
+        buildNode(&descs, root_, &rng_);
+    }
+    updateVersion();
 }
 
-void BinaryTree::buildNode(BinaryDescriptorSet dset, BinaryTreeNodePtr root){
+void BinaryTree::buildNode(std::vector<BinaryDescriptorPtr>* descs,
+                           BinaryTreeNodePtr root,
+                           std::mt19937* rng){
     
     // Validate if this should be a leaf node
     // 如果描述子数量小于s, 全部分配当前的叶节点中
-    if(dset.size() < s_){
+    if(descs->size() < s_){
         
         // We set the previous node as a leaf
         root->setLeaf(true);
 
         // Adding descriptors as leaf nodes
-        for(auto it = dset.begin(); it != dset.end(); it++){
-            
-            BinaryDescriptorPtr d = *it;
-            root->addChildDescriptor(d);
+        for(auto it = descs->begin(); it != descs->end(); it++){
+            root->addChildDescriptor(*it);
+        }
 
-            // Storing the reference of the node where the descriptor hangs
-            desc_to_node_[d] = root;
+        // Storing the reference of the node where the descriptors hang
+        for(auto it = descs->begin(); it != descs->end(); it++){
+            desc_to_node_.set(*it, root);
         }
     }
 
@@ -63,68 +137,169 @@ void BinaryTree::buildNode(BinaryDescriptorSet dset, BinaryTreeNodePtr root){
     else{
         
         // This node should be split
-        // Randomly selecting the new centers
-        std::vector<BinaryDescriptorPtr> new_centers;
-        std::vector<BinaryDescriptorSet> assoc_descs(k_);
+        std::vector<std::vector<BinaryDescriptorPtr> > assoc_descs;
+        splitNode(descs, root, &assoc_descs, rng);
 
-        // 随机分成k个子节点
-        for (unsigned i = 0; i < k_; i++){
-            
-            // Selecting a new center
-            // 随机选取一个描述子
-            BinaryDescriptorPtr desc = *std::next(dset.begin(), rand() % dset.size());
-            
-            // 将描述子插入到中心中
-            new_centers.push_back(desc);
-
-            // 将此描述子放入到子节点组中
-            assoc_descs[i].insert(desc);
-            
-            // 从总的节点数中删除掉此节点
-            dset.erase(desc);
-        }
-        
-        // 将每一个描述子放入到不同的节点中
-        // Associating the remaining descriptors to the new centers
-        for (auto it = dset.begin(); it != dset.end(); it++){
-            
-            BinaryDescriptorPtr d = *it;
-            int best_center = -1;
-            double min_dist = DBL_MAX;
-            for (unsigned i = 0; i < k_; i++){
-                double dist = obindex2::BinaryDescriptor::distHamming(*d, *(new_centers[i]));
-
-                if(dist < min_dist){
-                    min_dist = dist;
-                    best_center = i;
-                }
-            }
+        // 去除掉所有的描述子
+        std::vector<BinaryDescriptorPtr>().swap(*descs);
 
-            assert(best_center != -1);
-            assoc_descs[best_center].insert(d);
+        // Recursively apply the algorithm
+        // 迭代进行此操作
+        std::vector<BinaryTreeNodePtr>* nodes = root->getChildrenNodes();
+        for(unsigned i = 0; i < k_; i++){
+            buildNode(&assoc_descs[i], (*nodes)[i], rng);
         }
+    }
+}
 
-        // 去除掉所有的描述子
-        dset.clear();
+void BinaryTree::splitNode(std::vector<BinaryDescriptorPtr>* descs,
+                           BinaryTreeNodePtr root,
+                           std::vector<std::vector<BinaryDescriptorPtr> >* assoc_descs,
+                           std::mt19937* rng){
+
+    // Randomly selecting the new centers, moved to the front
+    // 随机选取k个描述子作为中心
+    unsigned ndescs = descs->size();
+    for(unsigned i = 0; i < k_; i++){
+        unsigned j = i + (*rng)() % (ndescs - i);
+        std::swap((*descs)[i], (*descs)[j]);
+    }
 
-        // Creating a new tree node for each new cluster
-        for (unsigned i = 0; i < k_; i++){
-            
-            // 生成一个新的节点
-            BinaryTreeNodePtr node = std::make_shared<BinaryTreeNode>(false, new_centers[i], root);
+    // Creating a new tree node for each new cluster
+    root->reserveChildren(k_, desc_bytes_);
 
-            // Linking this node with its root
-            // 将其附于父节点上
-            root->addChildNode(node);
+    assoc_descs->assign(k_, std::vector<BinaryDescriptorPtr>());
+    for(unsigned i = 0; i < k_; i++){
+
+        // 生成一个新的节点
+        BinaryTreeNodePtr node =
+            std::make_shared<BinaryTreeNode>(false, (*descs)[i], root.get());
+
+        // Linking this node with its root
+        // 将其附于父节点上
+        root->addChildNode(node);
+
+        // 将此描述子放入到子节点组中
+        (*assoc_descs)[i].push_back((*descs)[i]);
+    }
+
+    // Storing the reference to the new nodes
+    {
+        std::lock_guard<std::mutex> lock(nodes_mutex_);
+        std::vector<BinaryTreeNodePtr>* nodes = root->getChildrenNodes();
+        nset_.insert(nodes->begin(), nodes->end());
+    }
+
+    // 将每一个描述子放入到不同的节点中
+    // Associating the remaining descriptors to the new centers
+    std::vector<int> dists(k_);
+    for(unsigned i = k_; i < ndescs; i++){
+
+        BinaryDescriptorPtr d = (*descs)[i];
+        int best_center = closestChild(root.get(), d->bits_, dists.data());
+
+        assert(best_center != -1);
+        (*assoc_descs)[best_center].push_back(d);
+    }
+}
 
-            // Storing the reference to this node
-            nset_.insert(node);
+void BinaryTree::buildSampled(std::vector<BinaryDescriptorPtr>* descs){
 
-            // Recursively apply the algorithm
-            // 迭代进行此操作
-            buildNode(assoc_descs[i], node);
+    unsigned ndescs = descs->size();
+    assert(sample_ > 0 && sample_ < ndescs);
+
+    // Random sample, moved to the front
+    for(unsigned i = 0; i < sample_; i++){
+        unsigned j = i + rng_() % (ndescs - i);
+        std::swap((*descs)[i], (*descs)[j]);
+    }
+    std::vector<BinaryDescriptorPtr> sample(descs->begin(),
+                                            descs->begin() + sample_);
+
+    // Upper levels, split on the sample only
+    std::vector<BinaryTreeNodePtr> frontier;
+    buildUpperNode(&sample, root_, static_cast<double>(ndescs) / sample_,
+                   &frontier);
+
+    std::unordered_map<const BinaryTreeNode*, unsigned> frontier_id;
+    for(unsigned f = 0; f < frontier.size(); f++){
+        frontier_id[frontier[f].get()] = f;
+    }
+
+    // Streaming every descriptor through the upper levels, which are not
+    // modified anymore, down to the node whose subtree will hold it
+    std::vector<unsigned> assignment(ndescs);
+
+    #pragma omp parallel
+    {
+        std::vector<int> dists(k_);
+
+        #pragma omp for schedule(static)
+        for(int i = 0; i < static_cast<int>(ndescs); i++){
+
+            const BinaryTreeNode* n = root_.get();
+            while(n->childNodeSize() > 0){
+                int best_node = closestChild(n, (*descs)[i]->bits_, dists.data());
+                n = n->getChildNode(best_node).get();
+            }
+            assignment[i] = frontier_id.find(n)->second;
         }
     }
+
+    // Bucketing the descriptors by subtree
+    std::vector<unsigned> first(frontier.size() + 1, 0);
+    for(unsigned i = 0; i < ndescs; i++){
+        first[assignment[i] + 1]++;
+    }
+    for(unsigned f = 0; f < frontier.size(); f++){
+        first[f + 1] += first[f];
+    }
+
+    std::vector<BinaryDescriptorPtr> sorted(ndescs);
+    std::vector<unsigned> next(first.begin(), first.end() - 1);
+    for(unsigned i = 0; i < ndescs; i++){
+        sorted[next[assignment[i]]++].swap((*descs)[i]);
+    }
+    std::vector<BinaryDescriptorPtr>().swap(*descs);
+
+    // Lower levels, each subtree built from all its descriptors by one
+    // thread, with its own random numbers whatever the thread
+    std::vector<unsigned> seeds(frontier.size());
+    for(unsigned f = 0; f < frontier.size(); f++){
+        seeds[f] = rng_();
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for(int f = 0; f < static_cast<int>(frontier.size()); f++){
+        std::vector<BinaryDescriptorPtr> bucket(sorted.begin() + first[f],
+                                                sorted.begin() + first[f + 1]);
+        std::mt19937 rng(seeds[f]);
+        buildNode(&bucket, frontier[f], &rng);
+    }
+}
+
+void BinaryTree::buildUpperNode(std::vector<BinaryDescriptorPtr>* sample,
+                                BinaryTreeNodePtr root,
+                                const double scale,
+                                std::vector<BinaryTreeNodePtr>* frontier){
+
+    // Split on the sample while the node still stands for k full leaves,
+    // with a few samples per center. Below, buildNode splits again from all
+    // the descriptors of the node
+    if(sample->size() < kMinSamplesPerChild * k_ ||
+       sample->size() * scale < static_cast<double>(k_) * s_){
+        frontier->push_back(root);
+        return;
+    }
+
+    std::vector<std::vector<BinaryDescriptorPtr> > assoc_descs;
+    splitNode(sample, root, &assoc_descs, &rng_);
+    std::vector<BinaryDescriptorPtr>().swap(*sample);
+
+    std::vector<BinaryTreeNodePtr>* nodes = root->getChildrenNodes();
+    for(unsigned i = 0; i < k_; i++){
+        buildUpperNode(&assoc_descs[i], (*nodes)[i], scale, frontier);
+    }
 }
 
 void BinaryTree::deleteTree(){
@@ -139,167 +314,272 @@ void BinaryTree::deleteTree(){
     }
 }
 
-unsigned BinaryTree::traverseFromRoot(BinaryDescriptorPtr q,
-                                      NodeQueuePtr pq,
-                                      DescriptorQueuePtr r){
-
-    nvisited_nodes_ = 0;
+unsigned BinaryTree::traverseFromRoot(const BinaryDescriptor& q,
+                                      NodePriorityQueue* pq,
+                                      DescriptorQueue* r,
+                                      BinaryDescriptorSet* checked){
 
     // 生成搜索的队列
-    traverseFromNode(q, root_, pq, r);
-
-    return nvisited_nodes_;
+    return traverseFromNode(q, root_.get(), pq, r, checked);
 }
 
-void BinaryTree::traverseFromNode(BinaryDescriptorPtr q,
-                                  BinaryTreeNodePtr n,
-                                  NodeQueuePtr pq,
-                                  DescriptorQueuePtr r){
-    nvisited_nodes_++;
-    
-    // If its a leaf node, the search ends
-    if(n->isLeaf()){
-      
-        // Adding points to R
-        BinaryDescriptorSet* descs = n->getChildrenDescriptors();
-        
-        for(auto it = descs->begin(); it != descs->end(); it++){
-            
-            BinaryDescriptorPtr d = *it;
-            double dist = obindex2::BinaryDescriptor::distHamming(*q, *d);
-            
-            DescriptorQueueItem item(dist, d);
-            r->push(item);
+unsigned BinaryTree::traverseFromNode(const BinaryDescriptor& q,
+                                      BinaryTreeNode* n,
+                                      NodePriorityQueue* pq,
+                                      DescriptorQueue* r,
+                                      BinaryDescriptorSet* checked){
+
+    std::vector<int> dists(k_);
+
+    // Descending greedily to a leaf, the discarded children are queued
+    while(!n->isLeaf()){
+
+        int best_node = closestChild(n, q.bits_, dists.data());
+        assert(best_node != -1);
+
+        std::vector<BinaryTreeNodePtr>* nodes = n->getChildrenNodes();
+        for(unsigned i = 0; i < nodes->size(); i++){
+            if(i != static_cast<unsigned>(best_node)){
+                pq->push(NodeQueueItem(dists[i], tree_id_, (*nodes)[i].get()));
+            }
         }
+
+        n = (*nodes)[best_node].get();
     }
-    else{
 
-        // Search continues
-        NodeSet* nodes = n->getChildrenNodes();
+    // Adding the points of the leaf not checked in a previous traversal
+    BinaryDescriptorSet* descs = n->getChildrenDescriptors();
+    unsigned nchecked = 0;
 
-        int best_node = -1;
-        double min_dist = DBL_MAX;
+    for(auto it = descs->begin(); it != descs->end(); it++){
 
-        // Computing distances to nodes
-        std::vector<NodeQueueItem> items;
-        unsigned node_id = 0;
-        
-        // Computing distances to nodes
-        
-        for(auto it = nodes->begin(); it != nodes->end(); it++){
-            
-            BinaryTreeNodePtr bn = *it;
-            
-            double dist = bn->distance(q);
-            
-            NodeQueueItem item(dist, tree_id_, bn);
-            
-            items.push_back(item);
-
-            if(dist < min_dist){
-                min_dist = dist;
-                best_node = node_id;
-            }
+        if(!checked->insert(*it).second){
+            continue;
+        }
+
+        HammingDist dist = obindex2::BinaryDescriptor::distHamming(q, **it);
+        r->push(DescriptorQueueItem(dist, &(*it)));
+        nchecked++;
+    }
 
-            node_id++;
+    return nchecked;
+}
+
+bool BinaryTree::traverseFromLeaf(const BinaryDescriptor& q,
+                                  BinaryTreeNodePtr leaf,
+                                  const bool scan,
+                                  NodePriorityQueue* pq,
+                                  DescriptorQueue* r,
+                                  BinaryDescriptorSet* checked,
+                                  unsigned* nchecked){
+
+    assert(leaf->isLeaf());
+    *nchecked = 0;
+
+    // A tree with a single leaf has no centers to compare with
+    BinaryTreeNode* parent = leaf->getRoot();
+    if(!parent){
+        *nchecked = traverseFromNode(q, leaf.get(), pq, r, checked);
+        return true;
+    }
+
+    std::vector<int> dists(k_);
+    int best_node = closestChild(parent, q.bits_, dists.data());
+
+    std::vector<BinaryTreeNodePtr>* nodes = parent->getChildrenNodes();
+    unsigned leaf_slot = 0;
+    while((*nodes)[leaf_slot] != leaf){
+        leaf_slot++;
+    }
+
+    // The query would not descend to this leaf from its parent, so it is
+    // probably far from the hinted word
+    if(dists[leaf_slot] > dists[best_node]){
+        return false;
+    }
+
+    for(unsigned i = 0; i < nodes->size(); i++){
+        if(!scan || i != leaf_slot){
+            pq->push(NodeQueueItem(dists[i], tree_id_, (*nodes)[i].get()));
         }
+    }
 
-        assert(best_node != -1);
+    // The siblings of every ancestor are queued as well, so that the search
+    // can backtrack out of the subtree of the hinted leaf as from a descent
+    const BinaryTreeNode* child = parent;
+    for(BinaryTreeNode* n = parent->getRoot(); n; n = n->getRoot()){
 
-        // Adding remaining nodes to pq
-        for(unsigned i = 0; i < items.size(); i++){
-            
-            // Is it the best node?
-            if(i == static_cast<unsigned>(best_node)){
-                continue;
-            }
+        closestChild(n, q.bits_, dists.data());
 
-            pq->push(items[i]);
+        std::vector<BinaryTreeNodePtr>* ns = n->getChildrenNodes();
+        for(unsigned i = 0; i < ns->size(); i++){
+            if((*ns)[i].get() != child){
+                pq->push(NodeQueueItem(dists[i], tree_id_, (*ns)[i].get()));
+            }
         }
+        child = n;
+    }
 
-        // Traversing the best node
-        traverseFromNode(q, items[best_node].node, pq, r);
+    if(scan){
+        *nchecked = traverseFromNode(q, leaf.get(), pq, r, checked);
     }
+
+    return true;
 }
 
-BinaryTreeNodePtr BinaryTree::searchFromRoot(BinaryDescriptorPtr q){
+BinaryTreeNodePtr BinaryTree::searchFromRoot(const BinaryDescriptor& q){
     return searchFromNode(q, root_);
 }
 
-BinaryTreeNodePtr BinaryTree::searchFromNode(BinaryDescriptorPtr q,
+BinaryTreeNodePtr BinaryTree::searchFromNode(const BinaryDescriptor& q,
                                              BinaryTreeNodePtr n){
-    
-    // If it's a leaf node, the search ends
-    if(n->isLeaf()){
-        // This is the node where this descriptor should be included
-        return n;
-    }
-    else{
-      
-        // Search continues
-        std::unordered_set<BinaryTreeNodePtr>* nodes = n->getChildrenNodes();
-        int best_node = -1;
-        double min_dist = DBL_MAX;
-
-        // Computing distances to nodes
-        std::vector<BinaryTreeNodePtr> items;
-        // Computing distances to nodes
-      
-        for(auto it = (*nodes).begin(); it != (*nodes).end(); it++){
-            
-            BinaryTreeNodePtr bn = *it;
-            items.push_back(bn);
-            double dist = bn->distance(q);
-
-            if(dist < min_dist){
-                min_dist = dist;
-                best_node = static_cast<int>(items.size()) - 1;
-            }
-        }
 
-        assert(best_node != -1);
+    std::vector<int> dists(k_);
 
-        // Searching in the best node
-        return searchFromNode(q, items[best_node]);
+    // Descending to the leaf where this descriptor should be included
+    while(!n->isLeaf()){
+        int best_node = closestChild(n.get(), q.bits_, dists.data());
+        assert(best_node != -1);
+        n = (*n->getChildrenNodes())[best_node];
     }
+
+    return n;
 }
 
 void BinaryTree::addDescriptor(BinaryDescriptorPtr q){
+
+    if(desc_bytes_ == 0){
+        setDescriptorBytes(q->size_in_bytes_);
+    }
         
-    BinaryTreeNodePtr n = searchFromRoot(q);
+    BinaryTreeNodePtr n = searchFromRoot(*q);
     assert(n->isLeaf());
     if(n->childDescriptorSize() + 1 < s_){
 
         // There is enough space at this node for this descriptor, so we add it
         n->addChildDescriptor(q);
         // Storing the reference of the node where the descriptor hangs
-        desc_to_node_[q] = n;
+        desc_to_node_.set(q, n);
     }
     else{
-      
+        OBINDEX2_PROFILE_SCOPE(PROFILE_TREE_LEAF_SPLIT);
+
         // This node should be split
         n->setLeaf(false);
 
         // Gathering the current descriptors
         std::unordered_set<BinaryDescriptorPtr>* descs =
                                                         n->getChildrenDescriptors();
-        BinaryDescriptorSet set;
-      
-        for (auto it = (*descs).begin(); it != (*descs).end(); it++){
-            BinaryDescriptorPtr d = *it;
-            set.insert(d);
-        }
-        set.insert(q);  // Adding the new descritor to the set
+        std::vector<BinaryDescriptorPtr> set(descs->begin(), descs->end());
+        set.push_back(q);  // Adding the new descritor to the set
 
         // Rebuilding this node
-        buildNode(set, n);
+        buildNode(&set, n, &rng_);
+        updateVersion();
+    }
+}
+
+void BinaryTree::addDescriptors(const std::vector<BinaryDescriptorPtr>& descs){
+
+    if(descs.empty()){
+        return;
+    }
+
+    if(desc_bytes_ == 0){
+        setDescriptorBytes(descs[0]->size_in_bytes_);
+    }
+
+    // Descending every descriptor to its leaf, the tree is not modified yet
+    std::vector<BinaryTreeNode*> leaves(descs.size());
+
+    #pragma omp parallel
+    {
+        std::vector<int> dists(k_);
+
+        #pragma omp for schedule(dynamic, 64)
+        for(unsigned i = 0; i < descs.size(); i++){
+
+            BinaryTreeNode* n = root_.get();
+            while(!n->isLeaf()){
+                int best_node = closestChild(n, descs[i]->bits_, dists.data());
+                assert(best_node != -1);
+                n = n->getChildNode(best_node).get();
+            }
+            leaves[i] = n;
+        }
+    }
+
+    // Grouping the descriptors by leaf, keeping their order
+    std::unordered_map<BinaryTreeNode*, unsigned> leaf_group;
+    leaf_group.reserve(descs.size());
+    std::vector<BinaryTreeNode*> group_leaves;
+    std::vector<std::vector<BinaryDescriptorPtr> > groups;
+
+    for(unsigned i = 0; i < descs.size(); i++){
+
+        auto it = leaf_group.emplace(leaves[i], groups.size());
+        if(it.second){
+            group_leaves.push_back(leaves[i]);
+            groups.push_back(std::vector<BinaryDescriptorPtr>());
+        }
+        groups[it.first->second].push_back(descs[i]);
+    }
+
+    // Filling or splitting each leaf. A split only creates nodes below its
+    // leaf, so the groups share no node and only the maps of the tree are
+    // locked. Each group has its own random numbers
+    std::vector<unsigned> seeds(groups.size());
+    for(unsigned i = 0; i < groups.size(); i++){
+        seeds[i] = rng_();
+    }
+
+    bool split = false;
+
+    #pragma omp parallel for schedule(dynamic) reduction(||:split)
+    for(unsigned i = 0; i < groups.size(); i++){
+
+        BinaryTreeNodePtr n = ownerOf(group_leaves[i]);
+        std::vector<BinaryDescriptorPtr>& group = groups[i];
+        assert(n->isLeaf());
+
+        if(n->childDescriptorSize() + group.size() < s_){
+
+            // There is enough space at this node for the descriptors
+            for(unsigned j = 0; j < group.size(); j++){
+                n->addChildDescriptor(group[j]);
+            }
+
+            for(unsigned j = 0; j < group.size(); j++){
+                desc_to_node_.set(group[j], n);
+            }
+        }
+        else{
+            OBINDEX2_PROFILE_SCOPE(PROFILE_TREE_LEAF_SPLIT);
+
+            // This node should be split, as addDescriptor does once the
+            // leaf is full
+            n->setLeaf(false);
+
+            BinaryDescriptorSet* leaf_descs = n->getChildrenDescriptors();
+            std::vector<BinaryDescriptorPtr> set(leaf_descs->begin(),
+                                                 leaf_descs->end());
+            set.insert(set.end(), group.begin(), group.end());
+
+            std::mt19937 rng(seeds[i]);
+            buildNode(&set, n, &rng);
+            split = true;
+        }
+    }
+
+    if(split){
+        updateVersion();
     }
 }
 
 void BinaryTree::deleteDescriptor(BinaryDescriptorPtr q){
     
     // We get the node where the descriptor is stored
-    BinaryTreeNodePtr node = desc_to_node_[q];
+    BinaryTreeNodePtr node = desc_to_node_.find(q);
     assert(node->isLeaf());
 
     // We remove q from the node
@@ -309,15 +589,21 @@ void BinaryTree::deleteDescriptor(BinaryDescriptorPtr q){
         // We select a new center, if required
         if(node->getDescriptor() == q){
             // Selecting a new center
-            node->selectNewCenter();
+            node->selectNewCenter(&rng_);
+
+            // The parent keeps its own copy of the center
+            if(node->getRoot()){
+                node->getRoot()->updateChildCenter(node.get());
+                updateVersion();
+            }
         }
     }
-    else{
+    else if(node != root_){
 
         // Otherwise, we need to remove the node
-        BinaryTreeNodePtr parent = node->getRoot();
-        parent->deleteChildNode(node);
-        nset_.erase(node);
+        BinaryTreeNode* parent = node->getRoot();
+        nset_.erase(parent->deleteChildNode(node.get()));
+        updateVersion();
 
         deleteNodeRecursive(parent);
     }
@@ -325,7 +611,7 @@ void BinaryTree::deleteDescriptor(BinaryDescriptorPtr q){
     desc_to_node_.erase(q);
 }
 
-void BinaryTree::deleteNodeRecursive(BinaryTreeNodePtr n){
+void BinaryTree::deleteNodeRecursive(BinaryTreeNode* n){
     
     assert(!n->isLeaf());
     
@@ -335,16 +621,74 @@ void BinaryTree::deleteNodeRecursive(BinaryTreeNodePtr n){
         n->setBad(true);
     }
 
-    if(n->childNodeSize() == 0 && n != root_){
+    if(n->childNodeSize() == 0 && n != root_.get()){
         // We remove this node
-        BinaryTreeNodePtr parent = n->getRoot();
-        parent->deleteChildNode(n);
-        nset_.erase(n);
+        BinaryTreeNode* parent = n->getRoot();
+        nset_.erase(parent->deleteChildNode(n));
 
         deleteNodeRecursive(parent);
     }
 }
 
+BinaryTreeNodePtr BinaryTree::ownerOf(const BinaryTreeNode* n) const {
+
+    BinaryTreeNode* parent = n->getRoot();
+    if(!parent){
+        return root_;
+    }
+
+    std::vector<BinaryTreeNodePtr>* nodes = parent->getChildrenNodes();
+    unsigned slot = 0;
+    while((*nodes)[slot].get() != n){
+        slot++;
+    }
+
+    return (*nodes)[slot];
+}
+
+const BinaryTreeNode* BinaryTree::descendToLevel(const unsigned char* q,
+                                                 const unsigned level,
+                                                 int* dists) const {
+
+    const BinaryTreeNode* n = root_.get();
+    for(unsigned l = 0; l < level && !n->isLeaf(); l++){
+        int best_node = closestChild(n, q, dists);
+        assert(best_node != -1);
+        n = n->getChildNode(best_node).get();
+    }
+
+    return n;
+}
+
+void BinaryTree::setDescriptorBytes(const unsigned nbytes){
+    desc_bytes_ = nbytes;
+    nearest_ = selectNearestChild(k_, nbytes);
+}
+
+void BinaryTree::updateVersion(){
+    version_ = ++next_tree_version;
+}
+
+size_t BinaryTree::memoryUsage() const {
+
+    // Hash containers store each element in a node with a next pointer and
+    // the cached hash, plus one bucket pointer per element on average
+    const size_t hash_entry = 3 * sizeof(void*);
+
+    // Each node: the object itself, its shared_ptr control block, its entry
+    // in nset_, its slot in its parent and the packed center in that slot
+    size_t bytes = nset_.size() * (sizeof(BinaryTreeNode) + 2 * sizeof(void*) +
+                                   sizeof(BinaryTreeNodePtr) + hash_entry +
+                                   sizeof(BinaryTreeNodePtr) + desc_bytes_);
+
+    // Each descriptor: its entry in a leaf and its entry in desc_to_node_
+    bytes += desc_to_node_.size() *
+             (sizeof(BinaryDescriptorPtr) + hash_entry +
+              sizeof(BinaryDescriptorPtr) + sizeof(BinaryTreeNodePtr) + hash_entry);
+
+    return bytes;
+}
+
 void BinaryTree::printTree(){
     printNode(root_);
 }
@@ -361,7 +705,7 @@ void BinaryTree::printNode(BinaryTreeNodePtr n){
     }
     else{
         std::cout << "Children nodes: " << n->childNodeSize() << std::endl;
-        std::unordered_set<BinaryTreeNodePtr>* nodes = n->getChildrenNodes();
+        std::vector<BinaryTreeNodePtr>* nodes = n->getChildrenNodes();
         for (auto it = (*nodes).begin(); it != (*nodes).end(); it++){
             printNode(*it);
         }
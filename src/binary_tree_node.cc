@@ -6,16 +6,78 @@ BinaryTreeNode::BinaryTreeNode() :
     is_leaf_(false),
     is_bad_(false),
     desc_(nullptr),
-    root_(nullptr)
+    root_(nullptr),
+    center_bytes_(0)
 {}
 
 BinaryTreeNode::BinaryTreeNode(const bool leaf,
                                BinaryDescriptorPtr desc,
-                               BinaryTreeNodePtr root) :
+                               BinaryTreeNode* root) :
     is_leaf_(leaf),
     is_bad_(false),
     desc_(desc),
-    root_(root)
+    root_(root),
+    center_bytes_(0)
 {}
 
+void BinaryTreeNode::reserveChildren(const unsigned k, const unsigned nbytes){
+
+    assert(ch_nodes_.empty());
+
+    ch_nodes_.reserve(k);
+    ch_centers_.assign(k * nbytes, 0);
+    center_bytes_ = nbytes;
+}
+
+void BinaryTreeNode::addChildNode(BinaryTreeNodePtr child){
+
+    unsigned slot = ch_nodes_.size();
+    assert((slot + 1) * center_bytes_ <= ch_centers_.size());
+    assert(child->getDescriptor()->size_in_bytes_ == center_bytes_);
+
+    ch_nodes_.push_back(child);
+    memcpy(&ch_centers_[slot * center_bytes_],
+           child->getDescriptor()->bits_,
+           center_bytes_);
+}
+
+BinaryTreeNodePtr BinaryTreeNode::deleteChildNode(const BinaryTreeNode* child){
+
+    for(unsigned i = 0; i < ch_nodes_.size(); i++){
+
+        if(ch_nodes_[i].get() != child){
+            continue;
+        }
+
+        // The last child takes the freed slot, the padding stays zeroed
+        BinaryTreeNodePtr removed = ch_nodes_[i];
+        unsigned last = ch_nodes_.size() - 1;
+
+        if(i != last){
+            ch_nodes_[i] = ch_nodes_[last];
+            memcpy(&ch_centers_[i * center_bytes_],
+                   &ch_centers_[last * center_bytes_],
+                   center_bytes_);
+        }
+        ch_nodes_.pop_back();
+        memset(&ch_centers_[last * center_bytes_], 0, center_bytes_);
+
+        return removed;
+    }
+
+    return nullptr;
+}
+
+void BinaryTreeNode::updateChildCenter(const BinaryTreeNode* child){
+
+    for(unsigned i = 0; i < ch_nodes_.size(); i++){
+        if(ch_nodes_[i].get() == child){
+            memcpy(&ch_centers_[i * center_bytes_],
+                   child->getDescriptor()->bits_,
+                   center_bytes_);
+            return;
+        }
+    }
+}
+
 }  // namespace obindex2
@@ -0,0 +1,67 @@
+#include "feature_dump.h"
+
+#include "serialization.h"
+
+namespace obindex2 {
+
+// Dump header
+static const uint32_t kDumpMagic = 0x4446424f;     // "OBFD"
+static const uint32_t kDumpVersion = 1;
+
+FeatureDumpWriter::FeatureDumpWriter(const std::string& filename) :
+    out_(filename.c_str(), std::ios::binary | std::ios::trunc)
+{
+    ByteWriter writer(&out_);
+    writer.put<uint32_t>(kDumpMagic);
+    writer.put<uint32_t>(kDumpVersion);
+}
+
+bool FeatureDumpWriter::write(const unsigned image_id,
+                              const std::vector<cv::KeyPoint>& kps,
+                              const cv::Mat& descs){
+
+    assert(descs.empty() || descs.type() == CV_8U);
+    assert(kps.size() == static_cast<size_t>(descs.rows));
+
+    ByteWriter writer(&out_);
+    writer.put<uint32_t>(image_id);
+    writer.putKeyPoints(kps);
+    writer.putMat(descs);
+
+    return writer.good();
+}
+
+FeatureDumpReader::FeatureDumpReader(const std::string& filename) :
+    in_(filename.c_str(), std::ios::binary),
+    valid_(false)
+{
+    ByteReader reader(&in_);
+    uint32_t magic = reader.get<uint32_t>();
+    uint32_t version = reader.get<uint32_t>();
+
+    valid_ = reader.good() && magic == kDumpMagic && version == kDumpVersion;
+}
+
+bool FeatureDumpReader::next(unsigned* image_id,
+                             std::vector<cv::KeyPoint>* kps,
+                             cv::Mat* descs){
+
+    if(!valid_){
+        return false;
+    }
+
+    ByteReader reader(&in_);
+    *image_id = reader.get<uint32_t>();
+    reader.getKeyPoints(kps);
+    *descs = reader.getMat();
+
+    // A record cut by the end of the file is not returned
+    if(!reader.good()){
+        valid_ = false;
+        return false;
+    }
+
+    return true;
+}
+
+}  // namespace obindex2
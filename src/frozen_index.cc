@@ -0,0 +1,384 @@
+#include "frozen_index.h"
+
+#include <limits>
+
+namespace obindex2 {
+
+namespace {
+
+// Pending node of a frozen tree
+struct FrozenQueueItem{
+    FrozenQueueItem(const HammingDist d, const uint32_t t, const uint32_t n) :
+        dist(d),
+        tree_id(static_cast<uint16_t>(t)),
+        node(n)
+    {}
+
+    HammingDist dist;
+    uint16_t tree_id;
+    uint32_t node;
+};
+
+typedef BucketQueue<FrozenQueueItem> FrozenPriorityQueue;
+
+// Candidate word found in a leaf
+struct FrozenCandidate{
+    FrozenCandidate(const HammingDist d, const uint32_t w) :
+        dist(d),
+        word(w)
+    {}
+
+    HammingDist dist;
+    uint32_t word;
+
+    inline bool operator<(const FrozenCandidate& c) const {
+        return dist < c.dist;
+    }
+};
+
+// Descends greedily from node to a leaf, queueing the discarded children
+// and collecting the words of the leaf not seen before. Mirrors
+// BinaryTree::traverseFromNode.
+unsigned traverseFrozen(const FrozenTree& tree,
+                        const uint32_t tree_id,
+                        uint32_t node,
+                        const unsigned char* q,
+                        const unsigned char* word_descs,
+                        const unsigned desc_bytes,
+                        FrozenPriorityQueue* pq,
+                        std::vector<FrozenCandidate>* r,
+                        std::unordered_set<uint32_t>* already_added){
+
+    std::vector<int> dists;
+
+    while(!tree.nodes[node].leaf){
+
+        const FrozenNode& n = tree.nodes[node];
+        if(n.count == 0){
+            return 0;
+        }
+
+        // The centers of the children are contiguous
+        const unsigned char* centers = &tree.centers[n.first * desc_bytes];
+
+        int best_node = -1;
+        int min_dist = std::numeric_limits<int>::max();
+        dists.resize(n.count);
+
+        for(uint32_t i = 0; i < n.count; i++){
+            dists[i] = hamming(q, centers + i * desc_bytes, desc_bytes);
+
+            if(dists[i] < min_dist){
+                min_dist = dists[i];
+                best_node = i;
+            }
+        }
+
+        // The best child is traversed, not queued
+        for(uint32_t i = 0; i < n.count; i++){
+            if(i != static_cast<uint32_t>(best_node)){
+                pq->push(FrozenQueueItem(dists[i], tree_id, n.first + i));
+            }
+        }
+
+        node = n.first + best_node;
+    }
+
+    // Scanning the words of the leaf
+    const FrozenNode& leaf = tree.nodes[node];
+    unsigned nadded = 0;
+
+    for(uint32_t i = leaf.first; i < leaf.first + leaf.count; i++){
+        uint32_t word = tree.leaf_words[i];
+        if(already_added->insert(word).second){
+            HammingDist dist = hamming(q, word_descs + word * desc_bytes,
+                                       desc_bytes);
+            r->push_back(FrozenCandidate(dist, word));
+            nadded++;
+        }
+    }
+
+    return nadded;
+}
+
+// Keeps in best the knn smallest distances among best and r[first, end)
+void updateBestDistances(const std::vector<FrozenCandidate>& r,
+                         const size_t first,
+                         const unsigned knn,
+                         std::priority_queue<HammingDist>* best){
+
+    for(size_t i = first; i < r.size(); i++){
+        if(best->size() < knn){
+            best->push(r[i].dist);
+        }
+        else if(knn > 0 && r[i].dist < best->top()){
+            best->pop();
+            best->push(r[i].dist);
+        }
+    }
+}
+
+}  // namespace
+
+FrozenIndex::FrozenIndex(const ImageIndex& index) :
+    desc_bytes_(index.desc_bytes_),
+    nimages_(index.nimages_),
+    first_image_(index.first_image_),
+    removed_images_(index.removed_images_),
+    search_epsilon_(index.search_epsilon_)
+{
+    // Words sorted by id
+    word_ids_.reserve(index.id_to_desc_.size());
+    for(auto it = index.id_to_desc_.begin(); it != index.id_to_desc_.end(); it++){
+        word_ids_.push_back(it->first);
+    }
+    std::sort(word_ids_.begin(), word_ids_.end());
+
+    std::unordered_map<BinaryDescriptorPtr, uint32_t> word_index;
+    word_index.reserve(word_ids_.size());
+
+    // Packing the descriptors and the postings
+    word_descs_.reserve(word_ids_.size() * desc_bytes_);
+    post_offsets_.reserve(word_ids_.size() + 1);
+    word_nimages_.reserve(word_ids_.size());
+    post_offsets_.push_back(0);
+
+    for(uint32_t w = 0; w < word_ids_.size(); w++){
+
+        BinaryDescriptorPtr d = index.id_to_desc_.at(word_ids_[w]);
+        word_index[d] = w;
+        word_descs_.insert(word_descs_.end(), d->bits_, d->bits_ + desc_bytes_);
+
+        const std::vector<InvIndexItem>& posts = index.inv_index_.at(d);
+        std::unordered_set<uint32_t> images;
+        for(unsigned i = 0; i < posts.size(); i++){
+            post_images_.push_back(posts[i].image_id);
+            images.insert(posts[i].image_id);
+        }
+
+        post_offsets_.push_back(post_images_.size());
+        word_nimages_.push_back(images.size());
+    }
+
+    // Laying out the trees
+    trees_.resize(index.trees_.size());
+    for(unsigned i = 0; i < index.trees_.size(); i++){
+        freezeTree(index.trees_[i], word_index, &trees_[i]);
+    }
+}
+
+void FrozenIndex::freezeTree(
+                const BinaryTreePtr& tree,
+                const std::unordered_map<BinaryDescriptorPtr, uint32_t>& word_index,
+                FrozenTree* ftree){
+
+    // Breadth-first traversal: the children of each node get consecutive
+    // positions, so their centers end up next to each other
+    std::vector<BinaryTreeNodePtr> order;
+    order.push_back(tree->getRoot());
+    ftree->centers.resize(desc_bytes_, 0);  // The root has no center
+
+    for(size_t i = 0; i < order.size(); i++){
+
+        BinaryTreeNodePtr n = order[i];
+        FrozenNode fnode;
+
+        if(n->isLeaf()){
+
+            BinaryDescriptorSet* descs = n->getChildrenDescriptors();
+            fnode.leaf = 1;
+            fnode.first = ftree->leaf_words.size();
+            fnode.count = descs->size();
+
+            for(auto it = descs->begin(); it != descs->end(); it++){
+                ftree->leaf_words.push_back(word_index.at(*it));
+            }
+        }
+        else{
+
+            std::vector<BinaryTreeNodePtr>* nodes = n->getChildrenNodes();
+            fnode.leaf = 0;
+            fnode.first = order.size();
+            fnode.count = nodes->size();
+
+            // The packed centers the dynamic tree searches with
+            const unsigned char* centers = n->childCenters();
+            ftree->centers.insert(ftree->centers.end(),
+                                  centers,
+                                  centers + nodes->size() * desc_bytes_);
+            order.insert(order.end(), nodes->begin(), nodes->end());
+        }
+
+        ftree->nodes.push_back(fnode);
+    }
+
+    ftree->nodes.shrink_to_fit();
+    ftree->centers.shrink_to_fit();
+    ftree->leaf_words.shrink_to_fit();
+}
+
+void FrozenIndex::searchImages(const cv::Mat& descs,
+                               const std::vector<cv::DMatch>& gmatches,
+                               std::vector<ImageMatch>* img_matches,
+                               bool sort) const {
+
+    ScoreBuffer buf;
+    buf.base = first_image_;
+    buf.scores.resize(nimages_ - first_image_, 0.0);
+
+    // Counting the number of each word in the current document
+    for(unsigned i = 0; i < gmatches.size(); i++){
+        buf.nwi[gmatches[i].trainIdx]++;
+    }
+
+    for(unsigned match_index = 0; match_index < gmatches.size(); match_index++){
+
+        int train_idx = gmatches[match_index].trainIdx;
+        int w = wordIndex(train_idx);
+        if(w < 0){
+            continue;
+        }
+
+        // Computing the TF-IDF weighting term
+        double tf = static_cast<double>(buf.nwi[train_idx]) / descs.rows;
+        double idf = log(static_cast<double>(numActiveImages()) /
+                         word_nimages_[w]);
+        double tfidf = tf * idf;
+
+        for(uint32_t i = post_offsets_[w]; i < post_offsets_[w + 1]; i++){
+            uint32_t im = post_images_[i];
+            if(buf.scores[im - buf.base] == 0.0){
+                buf.touched.push_back(im);
+            }
+            buf.scores[im - buf.base] += tfidf;
+        }
+    }
+
+    collectImageScores(nimages_, &buf, img_matches, sort, &removed_images_);
+}
+
+void FrozenIndex::searchDescriptors(const cv::Mat& descs,
+                                    std::vector<std::vector<cv::DMatch> >* matches,
+                                    const unsigned knn,
+                                    const unsigned checks) const {
+    searchDescriptors(DescriptorView(descs), matches, knn, checks);
+}
+
+void FrozenIndex::searchDescriptors(const DescriptorView& descs,
+                                    std::vector<std::vector<cv::DMatch> >* matches,
+                                    const unsigned knn,
+                                    const unsigned checks) const {
+
+    assert(descs.rows == 0 || descs.cols == desc_bytes_);
+
+    matches->clear();
+    matches->resize(descs.rows);
+
+    // The index is immutable, so queries are searched in parallel
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int i = 0; i < static_cast<int>(descs.rows); i++){
+
+        std::vector<uint32_t> neighs;
+        std::vector<HammingDist> dists;
+        searchDescriptor(descs.row(i), &neighs, &dists, knn, checks);
+
+        // Translating the resulting matches to CV structures
+        std::vector<cv::DMatch>& des_match = (*matches)[i];
+        for(unsigned j = 0; j < neighs.size(); j++){
+            cv::DMatch match;
+            match.queryIdx = i;
+            match.trainIdx = static_cast<int>(word_ids_[neighs[j]]);
+            match.imgIdx = static_cast<int>(post_images_[post_offsets_[neighs[j]]]);
+            match.distance = dists[j];
+            des_match.push_back(match);
+        }
+    }
+}
+
+void FrozenIndex::searchDescriptor(const unsigned char* q,
+                                   std::vector<uint32_t>* neigh,
+                                   std::vector<HammingDist>* distances,
+                                   const unsigned knn,
+                                   const unsigned checks) const {
+
+    unsigned points_searched = 0;
+    FrozenPriorityQueue pq;
+    std::vector<FrozenCandidate> r;
+    std::unordered_set<uint32_t> already_added;
+    std::priority_queue<HammingDist> best;
+
+    // Descending each tree from the root
+    for(uint32_t t = 0; t < trees_.size(); t++){
+        size_t first = r.size();
+        points_searched += traverseFrozen(trees_[t], t, 0, q,
+                                          word_descs_.data(), desc_bytes_,
+                                          &pq, &r, &already_added);
+        updateBestDistances(r, first, knn, &best);
+    }
+
+    // Best-first search across the trees, as in the dynamic index
+    while(points_searched < checks && !pq.empty()){
+
+        FrozenQueueItem n = pq.top();
+        if(best.size() == knn && n.dist > (1.0 + search_epsilon_) * best.top()){
+            break;
+        }
+        pq.pop();
+
+        size_t first = r.size();
+        points_searched += traverseFrozen(trees_[n.tree_id], n.tree_id,
+                                          n.node, q, word_descs_.data(),
+                                          desc_bytes_, &pq, &r, &already_added);
+        updateBestDistances(r, first, knn, &best);
+    }
+
+    std::sort(r.begin(), r.end());
+
+    // Returning the required number of descriptors
+    neigh->clear();
+    distances->clear();
+    unsigned ndescs = std::min<unsigned>(knn, r.size());
+
+    for(unsigned i = 0; i < ndescs; i++){
+        neigh->push_back(r[i].word);
+        distances->push_back(r[i].dist);
+    }
+}
+
+void FrozenIndex::setSearchEpsilon(const double epsilon){
+    assert(epsilon >= 0.0);
+    search_epsilon_ = epsilon;
+}
+
+int FrozenIndex::wordIndex(const unsigned desc_id) const {
+
+    auto it = std::lower_bound(word_ids_.begin(), word_ids_.end(), desc_id);
+    if(it == word_ids_.end() || *it != desc_id){
+        return -1;
+    }
+
+    return static_cast<int>(it - word_ids_.begin());
+}
+
+MemoryUsage FrozenIndex::memoryUsage() const {
+
+    MemoryUsage usage;
+
+    for(unsigned i = 0; i < trees_.size(); i++){
+        const FrozenTree& t = trees_[i];
+        usage.trees += t.nodes.capacity() * sizeof(FrozenNode) +
+                       t.centers.capacity() +
+                       t.leaf_words.capacity() * sizeof(uint32_t);
+    }
+
+    // One copy of each descriptor, the leaves refer to it by word index
+    usage.descriptors = word_descs_.capacity();
+
+    usage.inv_index = (post_offsets_.capacity() + post_images_.capacity() +
+                       word_nimages_.capacity()) * sizeof(uint32_t);
+    usage.id_maps = word_ids_.capacity() * sizeof(uint32_t);
+
+    return usage;
+}
+
+}  // namespace obindex2
@@ -0,0 +1,236 @@
+#include "index_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sstream>
+#include <stdexcept>
+
+#include "serialization.h"
+
+namespace obindex2 {
+
+namespace {
+
+// Every record is a header followed by size bytes of payload
+struct LogRecordHeader{
+    uint32_t type;
+    uint32_t size;
+    uint64_t lsn;
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+// Records larger than this are considered corrupted
+const uint32_t kMaxRecordSize = 1u << 30;
+
+// FNV-1a over the record type, sequence number and payload
+uint32_t recordChecksum(const unsigned type,
+                        const uint64_t lsn,
+                        const std::string& payload){
+
+    uint32_t hash = 2166136261u;
+
+    uint64_t fields[2] = {type, lsn};
+    const unsigned char* f = reinterpret_cast<const unsigned char*>(fields);
+    for(unsigned i = 0; i < sizeof(fields); i++){
+        hash = (hash ^ f[i]) * 16777619u;
+    }
+
+    for(unsigned i = 0; i < payload.size(); i++){
+        hash = (hash ^ static_cast<unsigned char>(payload[i])) * 16777619u;
+    }
+
+    return hash;
+}
+
+}  // namespace
+
+IndexLog::IndexLog(const std::string& path,
+                   const uint64_t next_lsn,
+                   const uint64_t valid_bytes,
+                   const unsigned group_records,
+                   const size_t group_bytes) :
+    path_(path),
+    fd_(-1),
+    next_lsn_(next_lsn),
+    group_records_(group_records),
+    group_bytes_(group_bytes),
+    npending_(0)
+{
+    assert(next_lsn_ > 0);
+
+    fd_ = open(path_.c_str(), O_WRONLY | O_CREAT, 0644);
+    if(fd_ < 0 ||
+       ftruncate(fd_, valid_bytes) < 0 ||
+       lseek(fd_, 0, SEEK_END) < 0){
+        throw std::runtime_error("obindex2: cannot open log " + path_);
+    }
+}
+
+IndexLog::~IndexLog(){
+    commit();
+    close(fd_);
+}
+
+void IndexLog::appendAddImage(const unsigned image_id,
+                              const std::vector<cv::KeyPoint>& kps,
+                              const cv::Mat& descs){
+
+    std::ostringstream payload;
+    ByteWriter writer(&payload);
+    writer.put<uint32_t>(image_id);
+    writer.putKeyPoints(kps);
+    writer.putMat(descs);
+
+    append(LOG_RECORD_ADD_IMAGE, payload.str());
+}
+
+void IndexLog::appendAddImage(const unsigned image_id,
+                              const std::vector<cv::KeyPoint>& kps,
+                              const cv::Mat& descs,
+                              const std::vector<cv::DMatch>& matches){
+
+    std::ostringstream payload;
+    ByteWriter writer(&payload);
+    writer.put<uint32_t>(image_id);
+    writer.putKeyPoints(kps);
+    writer.putMat(descs);
+    writer.putMatches(matches);
+
+    append(LOG_RECORD_ADD_IMAGE_MATCHES, payload.str());
+}
+
+void IndexLog::appendDeleteDescriptor(const unsigned desc_id){
+
+    std::ostringstream payload;
+    ByteWriter writer(&payload);
+    writer.put<uint32_t>(desc_id);
+
+    append(LOG_RECORD_DELETE_DESCRIPTOR, payload.str());
+}
+
+void IndexLog::appendRemoveImage(const unsigned image_id){
+
+    std::ostringstream payload;
+    ByteWriter writer(&payload);
+    writer.put<uint32_t>(image_id);
+
+    append(LOG_RECORD_REMOVE_IMAGE, payload.str());
+}
+
+void IndexLog::append(const unsigned type, const std::string& payload){
+
+    LogRecordHeader header;
+    header.type = type;
+    header.size = payload.size();
+    header.lsn = next_lsn_++;
+    header.checksum = recordChecksum(type, header.lsn, payload);
+    header.reserved = 0;
+
+    pending_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    pending_.append(payload);
+    npending_++;
+
+    // Group commit
+    if(npending_ >= group_records_ || pending_.size() >= group_bytes_){
+        commit();
+    }
+}
+
+bool IndexLog::commit(){
+
+    if(npending_ == 0){
+        return true;
+    }
+
+    const char* data = pending_.data();
+    size_t n = pending_.size();
+    while(n > 0){
+        ssize_t written = write(fd_, data, n);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        n -= static_cast<size_t>(written);
+    }
+
+    pending_.clear();
+    npending_ = 0;
+
+    return fdatasync(fd_) == 0;
+}
+
+bool IndexLog::truncate(){
+
+    // Pending records are part of the snapshot too
+    pending_.clear();
+    npending_ = 0;
+
+    return ftruncate(fd_, 0) == 0 &&
+           lseek(fd_, 0, SEEK_SET) == 0 &&
+           fdatasync(fd_) == 0;
+}
+
+bool syncFile(const std::string& path){
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0){
+        return false;
+    }
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+bool syncParentDirectory(const std::string& path){
+
+    size_t slash = path.find_last_of('/');
+    std::string dir = slash == std::string::npos ? "." :
+                      slash == 0 ? "/" : path.substr(0, slash);
+
+    return syncFile(dir);
+}
+
+IndexLogReader::IndexLogReader(const std::string& path) :
+    in_(path.c_str(), std::ios::binary),
+    valid_bytes_(0)
+{}
+
+bool IndexLogReader::next(LogRecord* record){
+
+    if(!in_.good()){
+        return false;
+    }
+
+    LogRecordHeader header;
+    in_.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if(!in_.good() || header.size > kMaxRecordSize){
+        return false;
+    }
+
+    record->payload.resize(header.size);
+    if(header.size > 0){
+        in_.read(&record->payload[0], header.size);
+        if(!in_.good()){
+            return false;
+        }
+    }
+
+    if(recordChecksum(header.type, header.lsn, record->payload) != header.checksum){
+        return false;
+    }
+
+    record->type = header.type;
+    record->lsn = header.lsn;
+    valid_bytes_ += sizeof(header) + header.size;
+
+    return true;
+}
+
+}  // namespace obindex2
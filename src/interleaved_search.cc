@@ -0,0 +1,385 @@
+#include "interleaved_search.h"
+
+#include <limits>
+
+namespace obindex2 {
+
+namespace {
+
+enum SearchStep{
+    STEP_EXPAND,        // The node is loaded, gathering its children
+    STEP_NODE_DIST,     // The packed centers of the children are loaded
+    STEP_LEAF_BITS,     // The descriptors of the leaf are loaded
+    STEP_LEAF_DIST,     // The bits of the descriptors are loaded
+    STEP_DONE
+};
+
+// Traversal of one query, suspended between steps
+struct QueryState{
+    unsigned row;
+    const unsigned char* q;
+    SearchStep step;
+
+    unsigned next_tree;         // Next tree to descend from its root
+    std::vector<bool> hinted;   // Trees seeded from the hint, not descended
+    unsigned tree_id;           // Tree of the node being visited
+    BinaryTreeNode* node;
+
+    NodePriorityQueue pq;
+    DescriptorQueue r;
+    BinaryDescriptorSet checked;
+    std::priority_queue<HammingDist> best;
+    unsigned points_searched;
+
+    // Two closest words, kept instead of r by the fused ratio test
+    const BinaryDescriptorPtr* nn[2];
+    HammingDist nn_dist[2];
+
+    // Descriptors of the leaf being visited, they live in the leaf set
+    std::vector<const BinaryDescriptorPtr*> descs;
+    std::vector<int> node_dists;
+};
+
+inline void prefetch(const void* p){
+    __builtin_prefetch(p, 0, 3);
+}
+
+// Keeps desc if it is one of the two closest words of the query
+inline void keepClosest(QueryState* s,
+                        const HammingDist dist,
+                        const BinaryDescriptorPtr* desc){
+    if(dist < s->nn_dist[0]){
+        s->nn[1] = s->nn[0];
+        s->nn_dist[1] = s->nn_dist[0];
+        s->nn[0] = desc;
+        s->nn_dist[0] = dist;
+    }
+    else if(dist < s->nn_dist[1]){
+        s->nn[1] = desc;
+        s->nn_dist[1] = dist;
+    }
+}
+
+// The closest word passes the ratio test against the second one
+inline bool passesRatio(const QueryState& s,
+                        const double ratio,
+                        const double max_dist){
+    return s.nn[1] != nullptr && s.nn_dist[0] <= max_dist &&
+           s.nn_dist[0] < ratio * s.nn_dist[1];
+}
+
+inline void enterNode(QueryState* s,
+                      const unsigned tree_id,
+                      BinaryTreeNode* node){
+    s->tree_id = tree_id;
+    s->node = node;
+    s->step = STEP_EXPAND;
+    prefetch(s->node);
+}
+
+}  // namespace
+
+InterleavedSearch::InterleavedSearch(const std::vector<BinaryTreePtr>& trees,
+                                     const unsigned desc_bytes,
+                                     const double epsilon,
+                                     const unsigned knn,
+                                     const unsigned checks,
+                                     const unsigned group) :
+    trees_(trees),
+    desc_bytes_(desc_bytes),
+    epsilon_(epsilon),
+    knn_(knn),
+    checks_(checks),
+    group_(group)
+{
+    assert(group_ > 0);
+}
+
+void InterleavedSearch::search(
+                        const DescriptorView& descs,
+                        const std::vector<BinaryDescriptorPtr>& hints,
+                        std::vector<std::vector<BinaryDescriptorPtr> >* neighs,
+                        std::vector<std::vector<HammingDist> >* dists) const {
+
+    neighs->clear();
+    neighs->resize(descs.rows);
+    dists->clear();
+    dists->resize(descs.rows);
+
+    run(descs, hints, 0.0, 0.0, [&](QueryState* s){
+
+        s->r.sort();
+
+        unsigned ndescs = std::min(knn_, s->r.size());
+        for(unsigned i = 0; i < ndescs; i++){
+            const DescriptorQueueItem& d = s->r.get(i);
+            (*neighs)[s->row].push_back(*d.desc);
+            (*dists)[s->row].push_back(d.dist);
+        }
+    });
+}
+
+unsigned InterleavedSearch::searchRatio(
+                        const DescriptorView& descs,
+                        const std::vector<BinaryDescriptorPtr>& hints,
+                        const double ratio,
+                        const double max_dist,
+                        BinaryDescriptorPtr* best,
+                        HammingDist* dists) const {
+
+    assert(ratio > 0.0);
+
+    unsigned nrejected = 0;
+    run(descs, hints, ratio, max_dist, [&](QueryState* s){
+
+        if(passesRatio(*s, ratio, max_dist)){
+            best[s->row] = *s->nn[0];
+            dists[s->row] = s->nn_dist[0];
+        }
+        else{
+            best[s->row].reset();
+            nrejected++;
+        }
+    });
+
+    return nrejected;
+}
+
+template<typename Finish>
+void InterleavedSearch::run(const DescriptorView& descs,
+                            const std::vector<BinaryDescriptorPtr>& hints,
+                            const double ratio,
+                            const double max_dist,
+                            Finish finish) const {
+
+    assert(hints.empty() || hints.size() == descs.rows);
+
+    const bool fused = ratio > 0.0;
+
+    // Chooses the next node of a query, as the loops of searchDescriptor
+    auto advance = [&](QueryState* s){
+
+        while(s->next_tree < trees_.size() && s->hinted[s->next_tree]){
+            s->next_tree++;
+        }
+
+        if(s->next_tree < trees_.size()){
+            enterNode(s, s->next_tree, trees_[s->next_tree]->getRoot().get());
+            s->next_tree++;
+            return;
+        }
+
+        if(s->points_searched >= checks_ || s->pq.empty()){
+            s->step = STEP_DONE;
+            return;
+        }
+
+        NodeQueueItem n = s->pq.top();
+        if(fused){
+
+            // A passing query searches on as for knn = 2, since a closer
+            // second word can still reject it. A failing one only passes if
+            // a word closer than ratio times the best one, and within
+            // max_dist, shows up: the search stops once the pending nodes
+            // are too far for that
+            if(s->nn[1] != nullptr){
+                double bound = s->nn_dist[1];
+                if(!passesRatio(*s, ratio, max_dist)){
+                    bound = std::min(ratio * s->nn_dist[0], max_dist);
+                }
+                if(n.dist > (1.0 + epsilon_) * bound){
+                    s->step = STEP_DONE;
+                    return;
+                }
+            }
+        }
+        else if(s->best.size() == knn_ &&
+                n.dist > (1.0 + epsilon_) * s->best.top()){
+            s->step = STEP_DONE;
+            return;
+        }
+        s->pq.pop();
+
+        enterNode(s, n.tree_id, n.node);
+    };
+
+    // Starts the search of a row, seeding it from the hint if any
+    auto start = [&](QueryState* s, const unsigned row){
+
+        s->row = row;
+        s->q = descs.row(row);
+        s->pq.clear();
+        s->r.clear();
+        s->checked.clear();
+        s->best = std::priority_queue<HammingDist>();
+        s->points_searched = 0;
+        s->next_tree = 0;
+        s->hinted.assign(trees_.size(), false);
+        s->nn[0] = nullptr;
+        s->nn[1] = nullptr;
+        s->nn_dist[0] = std::numeric_limits<HammingDist>::max();
+        s->nn_dist[1] = std::numeric_limits<HammingDist>::max();
+
+        if(!hints.empty() && hints[row]){
+
+            BinaryDescriptor q(s->q, desc_bytes_, false);
+            bool seeded = false;
+
+            for(unsigned i = 0; i < trees_.size(); i++){
+
+                BinaryTreeNodePtr leaf = trees_[i]->getLeaf(hints[row]);
+                if(!leaf){
+                    continue;
+                }
+
+                unsigned first = s->r.size();
+                unsigned nchecked = 0;
+                if(trees_[i]->traverseFromLeaf(q, leaf, !seeded, &s->pq, &s->r,
+                                               &s->checked, &nchecked)){
+                    s->points_searched += nchecked;
+                    updateBestDistances(s->r, first, knn_, &s->best);
+                    s->hinted[i] = true;
+                    seeded = true;
+                }
+            }
+
+            // The fused search only keeps the two closest words of the
+            // seeded leaf
+            if(fused){
+                for(unsigned i = 0; i < s->r.size(); i++){
+                    keepClosest(s, s->r.get(i).dist, s->r.get(i).desc);
+                }
+                s->r.clear();
+            }
+        }
+
+        advance(s);
+    };
+
+    std::vector<QueryState> states(std::min(group_, descs.rows));
+    unsigned next_row = 0;
+    unsigned nactive = 0;
+
+    for(unsigned i = 0; i < states.size(); i++){
+        start(&states[i], next_row++);
+        nactive++;
+    }
+
+    // Round-robin over the group, one step per query
+    while(nactive > 0){
+
+        for(unsigned i = 0; i < states.size(); i++){
+
+            QueryState* s = &states[i];
+
+            switch(s->step){
+
+                case STEP_EXPAND:{
+
+                    if(s->node->isLeaf()){
+
+                        // Only the descriptors not checked through another
+                        // tree are loaded
+                        BinaryDescriptorSet* ds = s->node->getChildrenDescriptors();
+                        s->descs.clear();
+                        for(auto it = ds->begin(); it != ds->end(); it++){
+                            if(s->checked.insert(*it).second){
+                                s->descs.push_back(&(*it));
+                                prefetch(it->get());
+                            }
+                        }
+                        s->step = STEP_LEAF_BITS;
+                    }
+                    else{
+
+                        // The centers of all the children are contiguous
+                        const char* centers = reinterpret_cast<const char*>(
+                                                        s->node->childCenters());
+                        unsigned nbytes = s->node->childNodeSize() *
+                                          s->node->centerBytes();
+                        for(unsigned j = 0; j < nbytes; j += 64){
+                            prefetch(centers + j);
+                        }
+                        prefetch(s->node->getChildrenNodes()->data());
+                        s->step = STEP_NODE_DIST;
+                    }
+                    break;
+                }
+
+                case STEP_NODE_DIST:{
+
+                    // Same choice and queueing order as traverseFromNode
+                    const BinaryTreePtr& tree = trees_[s->tree_id];
+                    s->node_dists.resize(tree->branchingFactor());
+                    int best_node = tree->closestChild(s->node, s->q,
+                                                       s->node_dists.data());
+                    assert(best_node != -1);
+
+                    std::vector<BinaryTreeNodePtr>* nodes =
+                                                    s->node->getChildrenNodes();
+                    for(unsigned j = 0; j < nodes->size(); j++){
+                        if(j != static_cast<unsigned>(best_node)){
+                            s->pq.push(NodeQueueItem(s->node_dists[j], s->tree_id,
+                                                     (*nodes)[j].get()));
+                        }
+                    }
+
+                    enterNode(s, s->tree_id, (*nodes)[best_node].get());
+                    break;
+                }
+
+                case STEP_LEAF_BITS:{
+                    for(unsigned j = 0; j < s->descs.size(); j++){
+                        prefetch((*s->descs[j])->bits_);
+                    }
+                    s->step = STEP_LEAF_DIST;
+                    break;
+                }
+
+                case STEP_LEAF_DIST:{
+
+                    if(fused){
+                        for(unsigned j = 0; j < s->descs.size(); j++){
+                            HammingDist dist = hamming(s->q, (*s->descs[j])->bits_,
+                                                       desc_bytes_);
+                            keepClosest(s, dist, s->descs[j]);
+                        }
+                    }
+                    else{
+                        unsigned first = s->r.size();
+                        for(unsigned j = 0; j < s->descs.size(); j++){
+                            HammingDist dist = hamming(s->q, (*s->descs[j])->bits_,
+                                                       desc_bytes_);
+                            s->r.push(DescriptorQueueItem(dist, s->descs[j]));
+                        }
+                        updateBestDistances(s->r, first, knn_, &s->best);
+                    }
+                    s->points_searched += s->descs.size();
+
+                    advance(s);
+                    break;
+                }
+
+                case STEP_DONE:{
+
+                    if(s->row == descs.rows){
+                        break;      // Idle slot
+                    }
+
+                    finish(s);
+
+                    if(next_row < descs.rows){
+                        start(s, next_row++);
+                    }
+                    else{
+                        s->row = descs.rows;
+                        nactive--;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
+
+}  // namespace obindex2
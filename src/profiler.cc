@@ -0,0 +1,244 @@
+#include "profiler.h"
+
+#include <iomanip>
+
+namespace obindex2 {
+
+LatencyHistogram::LatencyHistogram(){
+    reset();
+}
+
+void LatencyHistogram::record(const uint64_t ns){
+
+    counts_[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(ns, std::memory_order_relaxed);
+
+    uint64_t prev = max_.load(std::memory_order_relaxed);
+    while(ns > prev &&
+          !max_.compare_exchange_weak(prev, ns, std::memory_order_relaxed)){
+    }
+}
+
+void LatencyHistogram::reset(){
+
+    for(unsigned i = 0; i < kBuckets; i++){
+        counts_[i].store(0, std::memory_order_relaxed);
+    }
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+    uint64_t n = count();
+    return n > 0 ? static_cast<double>(sum_.load(std::memory_order_relaxed)) / n : 0.0;
+}
+
+uint64_t LatencyHistogram::percentile(const double p) const {
+
+    uint64_t n = count();
+    if(n == 0){
+        return 0;
+    }
+
+    // Rank of the requested value, starting at 1
+    uint64_t rank = static_cast<uint64_t>(p / 100.0 * n + 0.5);
+    rank = std::max<uint64_t>(1, std::min(rank, n));
+
+    uint64_t accum = 0;
+    for(unsigned i = 0; i < kBuckets; i++){
+        accum += counts_[i].load(std::memory_order_relaxed);
+        if(accum >= rank){
+            return std::min(bucketUpperBound(i), max());
+        }
+    }
+
+    return max();
+}
+
+unsigned LatencyHistogram::bucketIndex(const uint64_t v){
+
+    const uint64_t sub_count = 1ull << kSubBits;
+
+    // Small values have one bucket each
+    if(v < sub_count){
+        return static_cast<unsigned>(v);
+    }
+
+    // Otherwise, the power of two selects the group and the next kSubBits
+    // bits the sub-bucket inside it
+    unsigned msb = 63 - __builtin_clzll(v);
+    unsigned shift = msb - kSubBits;
+
+    return ((shift + 1) << kSubBits) +
+           static_cast<unsigned>((v >> shift) - sub_count);
+}
+
+uint64_t LatencyHistogram::bucketUpperBound(const unsigned index){
+
+    const uint64_t sub_count = 1ull << kSubBits;
+
+    if(index < sub_count){
+        return index;
+    }
+
+    unsigned shift = (index >> kSubBits) - 1;
+    uint64_t sub = index & (sub_count - 1);
+
+    return ((sub_count + sub + 1) << shift) - 1;
+}
+
+Profiler& Profiler::instance(){
+    static Profiler profiler;
+    return profiler;
+}
+
+Profiler::Profiler() :
+    origin_(std::chrono::steady_clock::now()),
+    tracing_(false),
+    trace_written_(0)
+{}
+
+void Profiler::record(const ProfileEvent event,
+                      const std::chrono::steady_clock::time_point& start,
+                      const std::chrono::steady_clock::time_point& end){
+
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                            end - start).count();
+    hists_[event].record(ns);
+
+    if(tracing_.load(std::memory_order_relaxed)){
+
+        // Small sequential ids are easier to read than native thread ids
+        static std::atomic<unsigned> next_tid(0);
+        static thread_local unsigned tid = next_tid.fetch_add(1);
+
+        TraceEvent e;
+        e.event = event;
+        e.ts_us = std::chrono::duration<double, std::micro>(start - origin_).count();
+        e.dur_us = ns / 1000.0;
+        e.tid = tid;
+
+        // The trace may have been stopped since tracing_ was read
+        std::lock_guard<std::mutex> lock(trace_mutex_);
+        if(!trace_out_.is_open()){
+            return;
+        }
+
+        trace_.push_back(e);
+        if(trace_.size() >= kTraceFlushEvents){
+            flushTrace();
+        }
+    }
+}
+
+void Profiler::reset(){
+    for(unsigned i = 0; i < PROFILE_NUM_EVENTS; i++){
+        hists_[i].reset();
+    }
+}
+
+void Profiler::printSummary(std::ostream& out) const {
+
+    out << std::left << std::setw(20) << "Operation"
+        << std::right << std::setw(10) << "Count"
+        << std::setw(12) << "p50 (us)"
+        << std::setw(12) << "p90 (us)"
+        << std::setw(12) << "p99 (us)"
+        << std::setw(12) << "max (us)" << std::endl;
+
+    for(unsigned i = 0; i < PROFILE_NUM_EVENTS; i++){
+
+        const LatencyHistogram& h = hists_[i];
+        if(h.count() == 0){
+            continue;
+        }
+
+        out << std::left << std::setw(20) << eventName(static_cast<ProfileEvent>(i))
+            << std::right << std::setw(10) << h.count()
+            << std::fixed << std::setprecision(1)
+            << std::setw(12) << h.percentile(50) / 1000.0
+            << std::setw(12) << h.percentile(90) / 1000.0
+            << std::setw(12) << h.percentile(99) / 1000.0
+            << std::setw(12) << h.max() / 1000.0 << std::endl;
+    }
+}
+
+bool Profiler::startTrace(const std::string& filename){
+
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    if(trace_out_.is_open()){
+        trace_out_.close();
+    }
+
+    trace_out_.clear();
+    trace_out_.open(filename.c_str());
+    if(!trace_out_.good()){
+        return false;
+    }
+
+    // Complete events ("ph": "X") of the Chrome trace-event format
+    trace_out_ << "{\"traceEvents\":[" << std::fixed << std::setprecision(3);
+    trace_written_ = 0;
+    trace_.clear();
+    tracing_.store(true);
+
+    return true;
+}
+
+bool Profiler::stopTrace(){
+
+    tracing_.store(false);
+
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    if(!trace_out_.is_open()){
+        return false;
+    }
+
+    flushTrace();
+    trace_out_ << "\n]}" << std::endl;
+
+    bool ok = trace_out_.good();
+    trace_out_.close();
+    return ok;
+}
+
+void Profiler::flushTrace(){
+
+    for(unsigned i = 0; i < trace_.size(); i++, trace_written_++){
+        const TraceEvent& e = trace_[i];
+        trace_out_ << (trace_written_ > 0 ? ",\n" : "\n")
+                   << "{\"name\":\"" << eventName(e.event) << "\","
+                   << "\"cat\":\"obindex2\",\"ph\":\"X\","
+                   << "\"ts\":" << e.ts_us << ","
+                   << "\"dur\":" << e.dur_us << ","
+                   << "\"pid\":0,\"tid\":" << e.tid << "}";
+    }
+
+    trace_.clear();
+}
+
+const char* Profiler::eventName(const ProfileEvent event){
+
+    switch(event){
+        case PROFILE_SEARCH_DESCRIPTORS:
+            return "searchDescriptors";
+        case PROFILE_SEARCH_IMAGES:
+            return "searchImages";
+        case PROFILE_ADD_IMAGE_INSERT:
+            return "addImage/insert";
+        case PROFILE_ADD_IMAGE_MERGE:
+            return "addImage/merge";
+        case PROFILE_ADD_IMAGE_PURGE:
+            return "addImage/purge";
+        case PROFILE_TREE_LEAF_SPLIT:
+            return "tree/leafSplit";
+        case PROFILE_REBUILD:
+            return "rebuild";
+        default:
+            return "unknown";
+    }
+}
+
+}  // namespace obindex2
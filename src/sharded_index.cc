@@ -0,0 +1,633 @@
+#include "sharded_index.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#include "serialization.h"
+
+namespace obindex2 {
+
+namespace {
+
+// Requests understood by a shard. All but the shutdown are answered, with
+// SHARD_OP_ERROR and the error message if the request failed.
+enum ShardOp{
+    SHARD_OP_ADD_IMAGE = 1,
+    SHARD_OP_SEARCH_DESCRIPTORS,
+    SHARD_OP_SEARCH_IMAGES,
+    SHARD_OP_NUM_DESCRIPTORS,
+    SHARD_OP_REBUILD,
+    SHARD_OP_SHUTDOWN,
+    SHARD_OP_ERROR
+};
+
+// Every message is a header followed by size bytes of payload
+struct MessageHeader{
+    uint32_t op;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+void writeAll(int fd, const char* data, size_t n){
+
+    while(n > 0){
+        ssize_t written = send(fd, data, n, MSG_NOSIGNAL);
+        if(written < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            throw std::runtime_error("obindex2: error writing to shard socket");
+        }
+        data += written;
+        n -= static_cast<size_t>(written);
+    }
+}
+
+// Returns false if the connection was closed before reading anything
+bool readAll(int fd, char* data, size_t n){
+
+    size_t total = 0;
+    while(total < n){
+        ssize_t nread = recv(fd, data + total, n - total, 0);
+        if(nread < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            throw std::runtime_error("obindex2: error reading from shard socket");
+        }
+        if(nread == 0){
+            if(total == 0){
+                return false;
+            }
+            throw std::runtime_error("obindex2: truncated message from shard socket");
+        }
+        total += static_cast<size_t>(nread);
+    }
+
+    return true;
+}
+
+void sendMessage(int fd, const unsigned op, const std::string& payload){
+
+    MessageHeader header;
+    header.op = op;
+    header.reserved = 0;
+    header.size = payload.size();
+
+    writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header));
+    writeAll(fd, payload.data(), payload.size());
+}
+
+bool recvMessage(int fd, unsigned* op, std::string* payload){
+
+    MessageHeader header;
+    if(!readAll(fd, reinterpret_cast<char*>(&header), sizeof(header))){
+        return false;
+    }
+
+    *op = header.op;
+    payload->resize(header.size);
+    if(header.size > 0 && !readAll(fd, &(*payload)[0], header.size)){
+        throw std::runtime_error("obindex2: truncated message from shard socket");
+    }
+
+    return true;
+}
+
+sockaddr_un socketAddress(const std::string& path){
+
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(path.size() >= sizeof(addr.sun_path)){
+        throw std::runtime_error("obindex2: shard socket path too long: " + path);
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    return addr;
+}
+
+// Global id of a word of a shard. It is carried in the int fields of
+// cv::DMatch, so local ids too large for it are an error
+int globalId(const unsigned local_id,
+             const unsigned shard_id,
+             const unsigned nshards){
+
+    uint64_t id = static_cast<uint64_t>(local_id) * nshards + shard_id;
+    if(id > static_cast<uint64_t>(std::numeric_limits<int32_t>::max())){
+        std::stringstream ss;
+        ss << "obindex2: local id " << local_id << " of shard " << shard_id
+           << " does not fit a global id with " << nshards << " shards";
+        throw std::runtime_error(ss.str());
+    }
+
+    return static_cast<int>(id);
+}
+
+}  // namespace
+
+ShardServer::ShardServer(const std::string& socket_path,
+                         const unsigned shard_id,
+                         const unsigned nshards,
+                         const unsigned k,
+                         const unsigned s,
+                         const unsigned t,
+                         const MergePolicy merge_policy,
+                         const bool purge_descriptors,
+                         const unsigned min_feat_apps) :
+    socket_path_(socket_path),
+    shard_id_(shard_id),
+    nshards_(nshards),
+    index_(k, s, t, merge_policy, purge_descriptors, min_feat_apps)
+{
+    assert(shard_id_ < nshards_);
+}
+
+void ShardServer::run(){
+
+    // Listening for the coordinator
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0){
+        throw std::runtime_error("obindex2: cannot create shard socket");
+    }
+
+    sockaddr_un addr = socketAddress(socket_path_);
+    unlink(socket_path_.c_str());
+
+    if(bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+       listen(listen_fd, 1) < 0){
+        close(listen_fd);
+        throw std::runtime_error("obindex2: cannot listen on " + socket_path_);
+    }
+
+    int fd = accept(listen_fd, nullptr, nullptr);
+    close(listen_fd);
+    if(fd < 0){
+        throw std::runtime_error("obindex2: cannot accept on " + socket_path_);
+    }
+
+    unsigned op;
+    std::string request;
+    bool running = true;
+
+    while(running && recvMessage(fd, &op, &request)){
+
+        if(op == SHARD_OP_SHUTDOWN){
+            running = false;
+            continue;
+        }
+
+        // A failed request is reported to the coordinator, which gives up
+        try{
+            sendMessage(fd, op, serve(op, request));
+        }
+        catch(const std::exception& e){
+            sendMessage(fd, SHARD_OP_ERROR, e.what());
+        }
+    }
+
+    close(fd);
+    unlink(socket_path_.c_str());
+}
+
+std::string ShardServer::serve(const unsigned op, const std::string& request){
+
+    std::istringstream in(request);
+    ByteReader reader(&in);
+    std::ostringstream out;
+    ByteWriter writer(&out);
+
+    switch(op){
+
+        case SHARD_OP_ADD_IMAGE:{
+            unsigned image_id = reader.get<uint32_t>();
+            std::vector<cv::KeyPoint> kps;
+            reader.getKeyPoints(&kps);
+            cv::Mat descs = reader.getMat();
+            std::vector<cv::DMatch> matches;
+            reader.getMatches(&matches);
+
+            // The first features of a shard build its trees, which only
+            // the call without matches does. The shard has no words
+            // yet, so there is nothing to match against anyway
+            if(index_.numDescriptors() == 0 && descs.rows > 0){
+                assert(matches.empty());
+                index_.addImage(image_id, kps, descs);
+            }
+            else{
+                index_.addImage(image_id, kps, descs, matches);
+            }
+            break;
+        }
+
+        case SHARD_OP_SEARCH_DESCRIPTORS:{
+            unsigned knn = reader.get<uint32_t>();
+            unsigned checks = reader.get<uint32_t>();
+            cv::Mat descs = reader.getMat();
+
+            std::vector<std::vector<cv::DMatch> > matches;
+            index_.searchDescriptors(descs, &matches, knn, checks);
+
+            // Translating local word ids into global ids, the images
+            // already have their global id
+            writer.put<uint32_t>(matches.size());
+            for(unsigned i = 0; i < matches.size(); i++){
+                writer.put<uint32_t>(matches[i].size());
+                for(unsigned j = 0; j < matches[i].size(); j++){
+                    const cv::DMatch& m = matches[i][j];
+                    writer.put<int32_t>(globalId(m.trainIdx, shard_id_, nshards_));
+                    writer.put<int32_t>(m.imgIdx);
+                    writer.put<float>(m.distance);
+                }
+            }
+            break;
+        }
+
+        case SHARD_OP_SEARCH_IMAGES:{
+            unsigned nqueries = reader.get<uint32_t>();
+            unsigned total_images = reader.get<uint32_t>();
+            std::vector<cv::DMatch> gmatches;
+            reader.getMatches(&gmatches);
+
+            // The IDF term uses the number of images of the whole index
+            ScoreBuffer buf;
+            index_.scoreImages(nqueries, gmatches, total_images, &buf);
+
+            // Only images with some score are sent back
+            std::sort(buf.touched.begin(), buf.touched.end());
+            buf.touched.erase(std::unique(buf.touched.begin(), buf.touched.end()),
+                              buf.touched.end());
+
+            writer.put<uint32_t>(buf.touched.size());
+            for(unsigned i = 0; i < buf.touched.size(); i++){
+                unsigned im = buf.touched[i];
+                writer.put<uint32_t>(im);
+                writer.put<double>(buf.scores[im - buf.base]);
+            }
+            break;
+        }
+
+        case SHARD_OP_NUM_DESCRIPTORS:
+            writer.put<uint32_t>(index_.numDescriptors());
+            break;
+
+        case SHARD_OP_REBUILD:
+            index_.rebuild();
+            break;
+
+        default:
+            throw std::runtime_error("obindex2: unknown shard request");
+    }
+
+    if(!reader.good()){
+        throw std::runtime_error("obindex2: truncated shard request");
+    }
+
+    return out.str();
+}
+
+ShardedImageIndex::ShardedImageIndex(const unsigned nshards,
+                                     const std::string& socket_dir,
+                                     const unsigned k,
+                                     const unsigned s,
+                                     const unsigned t,
+                                     const MergePolicy merge_policy,
+                                     const bool purge_descriptors,
+                                     const unsigned min_feat_apps) :
+    nshards_(nshards),
+    nimages_(0)
+{
+    assert(nshards_ > 0);
+
+    try{
+        startShards(socket_dir, k, s, t, merge_policy, purge_descriptors,
+                    min_feat_apps);
+    }
+    catch(...){
+
+        // The shards started so far are stopped before giving up
+        for(unsigned i = 0; i < sockets_.size(); i++){
+            close(sockets_[i]);
+        }
+        for(unsigned i = 0; i < pids_.size(); i++){
+            kill(pids_[i], SIGTERM);
+            waitpid(pids_[i], nullptr, 0);
+        }
+        throw;
+    }
+}
+
+void ShardedImageIndex::startShards(const std::string& socket_dir,
+                                    const unsigned k,
+                                    const unsigned s,
+                                    const unsigned t,
+                                    const MergePolicy merge_policy,
+                                    const bool purge_descriptors,
+                                    const unsigned min_feat_apps){
+
+    for(unsigned i = 0; i < nshards_; i++){
+
+        std::stringstream ss;
+        ss << socket_dir << "/shard_" << i << ".sock";
+        std::string path = ss.str();
+
+        pid_t pid = fork();
+        if(pid < 0){
+            throw std::runtime_error("obindex2: cannot fork shard process");
+        }
+
+        if(pid == 0){
+
+            // Shard process: the connections to the previous shards belong
+            // to the coordinator
+            for(unsigned j = 0; j < sockets_.size(); j++){
+                close(sockets_[j]);
+            }
+
+            int status = 0;
+            try{
+                ShardServer server(path, i, nshards_, k, s, t, merge_policy,
+                                   purge_descriptors, min_feat_apps);
+                server.run();
+            }
+            catch(const std::exception& e){
+                std::cerr << e.what() << std::endl;
+                status = 1;
+            }
+            _exit(status);
+        }
+
+        pids_.push_back(pid);
+
+        // Connecting to the shard, waiting for it to start listening
+        sockaddr_un addr = socketAddress(path);
+        int fd = -1;
+        for(unsigned attempt = 0; attempt < 500 && fd < 0; attempt++){
+            fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0){
+                close(fd);
+                fd = -1;
+                usleep(10000);
+            }
+        }
+
+        if(fd < 0){
+            throw std::runtime_error("obindex2: cannot connect to shard " + path);
+        }
+
+        sockets_.push_back(fd);
+    }
+}
+
+ShardedImageIndex::~ShardedImageIndex(){
+
+    for(unsigned i = 0; i < sockets_.size(); i++){
+        try{
+            sendMessage(sockets_[i], SHARD_OP_SHUTDOWN, std::string());
+        }
+        catch(const std::exception&){
+            // The shard is already gone
+        }
+        close(sockets_[i]);
+    }
+
+    for(unsigned i = 0; i < pids_.size(); i++){
+        waitpid(pids_[i], nullptr, 0);
+    }
+}
+
+void ShardedImageIndex::addImage(const unsigned image_id,
+                                 const std::vector<cv::KeyPoint>& kps,
+                                 const cv::Mat& descs){
+    addImage(image_id, kps, descs, std::vector<cv::DMatch>());
+}
+
+void ShardedImageIndex::addImage(const unsigned image_id,
+                                 const std::vector<cv::KeyPoint>& kps,
+                                 const cv::Mat& descs,
+                                 const std::vector<cv::DMatch>& matches){
+
+    assert(image_id == nimages_);
+
+    // A matched feature is sent to the shard of each word it matches, as a
+    // match against the local id of the word. The other features become
+    // new words of the shard owning the image
+    std::vector<std::vector<int> > rows(nshards_);
+    std::vector<std::vector<cv::DMatch> > shard_matches(nshards_);
+    std::vector<int> slot(descs.rows * nshards_, -1);
+    std::vector<bool> matched(descs.rows, false);
+
+    for(unsigned i = 0; i < matches.size(); i++){
+
+        int q = matches[i].queryIdx;
+        unsigned shard = static_cast<unsigned>(matches[i].trainIdx) % nshards_;
+
+        int& row = slot[q * nshards_ + shard];
+        if(row < 0){
+            row = rows[shard].size();
+            rows[shard].push_back(q);
+        }
+
+        cv::DMatch m = matches[i];
+        m.queryIdx = row;
+        m.trainIdx = matches[i].trainIdx / nshards_;
+        shard_matches[shard].push_back(m);
+        matched[q] = true;
+    }
+
+    unsigned owner = image_id % nshards_;
+    for(int i = 0; i < descs.rows; i++){
+        if(!matched[i]){
+            rows[owner].push_back(i);
+        }
+    }
+
+    // Every shard adds the image, possibly without features, so that all of
+    // them number the images as the whole index does
+    for(unsigned i = 0; i < nshards_; i++){
+
+        std::vector<cv::KeyPoint> shard_kps(rows[i].size());
+        cv::Mat shard_descs(rows[i].size(), descs.cols, CV_8U);
+        for(unsigned j = 0; j < rows[i].size(); j++){
+            shard_kps[j] = kps[rows[i][j]];
+            memcpy(shard_descs.ptr<unsigned char>(j),
+                   descs.ptr<unsigned char>(rows[i][j]), descs.cols);
+        }
+
+        std::ostringstream payload;
+        ByteWriter writer(&payload);
+        writer.put<uint32_t>(image_id);
+        writer.putKeyPoints(shard_kps);
+        writer.putMat(shard_descs);
+        writer.putMatches(shard_matches[i]);
+        sendMessage(sockets_[i], SHARD_OP_ADD_IMAGE, payload.str());
+    }
+
+    // The shards index their part of the image in parallel
+    gather();
+
+    nimages_++;
+}
+
+void ShardedImageIndex::searchImages(const cv::Mat& descs,
+                                     const std::vector<cv::DMatch>& gmatches,
+                                     std::vector<ImageMatch>* img_matches,
+                                     bool sort){
+
+    // Splitting the matches by the shard owning each word
+    std::vector<std::vector<cv::DMatch> > shard_matches(nshards_);
+    for(unsigned i = 0; i < gmatches.size(); i++){
+        cv::DMatch m = gmatches[i];
+        m.trainIdx = gmatches[i].trainIdx / nshards_;
+        shard_matches[gmatches[i].trainIdx % nshards_].push_back(m);
+    }
+
+    // Scattering
+    for(unsigned i = 0; i < nshards_; i++){
+        std::ostringstream payload;
+        ByteWriter writer(&payload);
+        writer.put<uint32_t>(descs.rows);
+        writer.put<uint32_t>(nimages_);
+        writer.putMatches(shard_matches[i]);
+        sendMessage(sockets_[i], SHARD_OP_SEARCH_IMAGES, payload.str());
+    }
+
+    // Gathering
+    img_matches->resize(nimages_);
+    for(unsigned i = 0; i < nimages_; i++){
+        img_matches->at(i).image_id = i;
+        img_matches->at(i).score = 0.0;
+    }
+
+    std::vector<std::string> replies = gather();
+    for(unsigned i = 0; i < nshards_; i++){
+        std::istringstream in(replies[i]);
+        ByteReader reader(&in);
+        unsigned nscored = reader.get<uint32_t>();
+        for(unsigned j = 0; j < nscored; j++){
+            unsigned image_id = reader.get<uint32_t>();
+            double score = reader.get<double>();
+            img_matches->at(image_id).score += score;
+        }
+    }
+
+    if(sort){
+        std::sort(img_matches->begin(), img_matches->end());
+    }
+}
+
+void ShardedImageIndex::searchDescriptors(
+                                const cv::Mat& descs,
+                                std::vector<std::vector<cv::DMatch> >* matches,
+                                const unsigned knn,
+                                const unsigned checks){
+
+    std::ostringstream payload;
+    ByteWriter writer(&payload);
+    writer.put<uint32_t>(knn);
+    writer.put<uint32_t>(checks);
+    writer.putMat(descs);
+
+    // Scattering
+    broadcast(SHARD_OP_SEARCH_DESCRIPTORS, payload.str());
+
+    // Gathering the kNN lists of every shard
+    matches->clear();
+    matches->resize(descs.rows);
+
+    std::vector<std::string> replies = gather();
+    for(unsigned i = 0; i < nshards_; i++){
+        std::istringstream in(replies[i]);
+        ByteReader reader(&in);
+        unsigned nqueries = reader.get<uint32_t>();
+        assert(nqueries == matches->size());
+
+        for(unsigned q = 0; q < nqueries; q++){
+            unsigned n = reader.get<uint32_t>();
+            for(unsigned j = 0; j < n; j++){
+                cv::DMatch m;
+                m.queryIdx = q;
+                m.trainIdx = reader.get<int32_t>();
+                m.imgIdx = reader.get<int32_t>();
+                m.distance = reader.get<float>();
+                (*matches)[q].push_back(m);
+            }
+        }
+    }
+
+    // Merging: the knn closest among the candidates of all shards
+    for(unsigned q = 0; q < matches->size(); q++){
+        std::vector<cv::DMatch>& qmatches = (*matches)[q];
+        std::stable_sort(qmatches.begin(), qmatches.end());
+        if(qmatches.size() > knn){
+            qmatches.resize(knn);
+        }
+    }
+}
+
+void ShardedImageIndex::rebuild(){
+
+    broadcast(SHARD_OP_REBUILD, std::string());
+    gather();
+}
+
+unsigned ShardedImageIndex::numDescriptors(){
+
+    broadcast(SHARD_OP_NUM_DESCRIPTORS, std::string());
+
+    unsigned ndescs = 0;
+    std::vector<std::string> replies = gather();
+    for(unsigned i = 0; i < nshards_; i++){
+        std::istringstream in(replies[i]);
+        ByteReader reader(&in);
+        ndescs += reader.get<uint32_t>();
+    }
+
+    return ndescs;
+}
+
+void ShardedImageIndex::broadcast(const unsigned op, const std::string& payload){
+    for(unsigned i = 0; i < nshards_; i++){
+        sendMessage(sockets_[i], op, payload);
+    }
+}
+
+std::vector<std::string> ShardedImageIndex::gather(){
+
+    // Every answer is read before reporting a failure, so that no answer is
+    // left in the connections
+    std::vector<std::string> replies(nshards_);
+    std::string error;
+    for(unsigned i = 0; i < nshards_; i++){
+
+        unsigned op;
+        if(!recvMessage(sockets_[i], &op, &replies[i])){
+            throw std::runtime_error("obindex2: shard closed the connection");
+        }
+
+        if(op == SHARD_OP_ERROR && error.empty()){
+            std::stringstream ss;
+            ss << "obindex2: shard " << i << " failed: " << replies[i];
+            error = ss.str();
+        }
+    }
+
+    if(!error.empty()){
+        throw std::runtime_error(error);
+    }
+
+    return replies;
+}
+
+}  // namespace obindex2
@@ -0,0 +1,283 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "binary_index.h"
+#include "feature_dump.h"
+
+// Builds an index offline from a feature dump, image by image, and writes
+// it as a snapshot that ImageIndex::load reads back.
+//
+// Only a window of images read ahead of the index is kept in memory, so the
+// peak memory is the size of the index plus the window.
+//
+// The index numbers its images from 0 without gaps, in the order they are
+// added, so images skipped or ids missing in the dump renumber the rest.
+// Line i of <index.snap>.ids holds the dump id of image i of the index.
+
+struct Frame{
+    unsigned image_id;
+    std::vector<cv::KeyPoint> kps;
+    cv::Mat descs;
+};
+
+// Images read ahead by the reader thread, at most capacity of them
+class FrameQueue{
+public:
+    explicit FrameQueue(const unsigned capacity) :
+        capacity_(capacity),
+        done_(false)
+    {}
+
+    void push(Frame* f){
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]{ return frames_.size() < capacity_; });
+        frames_.push_back(Frame());
+        std::swap(frames_.back(), *f);
+        not_empty_.notify_one();
+    }
+
+    void close(){
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        not_empty_.notify_one();
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(Frame* f){
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]{ return !frames_.empty() || done_; });
+        if(frames_.empty()){
+            return false;
+        }
+        std::swap(*f, frames_.front());
+        frames_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+private:
+    unsigned capacity_;
+    bool done_;
+    std::deque<Frame> frames_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+static void usage(){
+    std::cerr << "Usage: obindex2_build <features.dump> <index.snap> [options]\n"
+              << "  --window N      images read ahead (default 16)\n"
+              << "  --k N           branching factor (default 16)\n"
+              << "  --s N           leaf size (default 150)\n"
+              << "  --t N           number of trees (default 4)\n"
+              << "  --checks N      points checked per search (default 64)\n"
+              << "  --ratio R       ratio test of the matches (default 0.8)\n"
+              << "  --rebuild N     rebuild the trees every N images, 0 never"
+                 " (default 250)\n"
+              << "  --budget-mb N   memory budget of the index, 0 unlimited"
+                 " (default 0)\n"
+              << "  --build-sample N  build the upper levels of the trees from"
+                 " N sampled words, 0 from all (default 0)\n"
+              << "  --merge P       merge policy: none, and, or (default and)\n"
+              << "  --no-purge      keep the unstable words\n";
+}
+
+int main(int argc, char** argv){
+
+    if(argc < 3){
+        usage();
+        return 1;
+    }
+
+    std::string dump_path = argv[1];
+    std::string index_path = argv[2];
+
+    unsigned window = 16;
+    unsigned k = 16;
+    unsigned s = 150;
+    unsigned t = 4;
+    unsigned checks = 64;
+    double ratio = 0.8;
+    unsigned rebuild_every = 250;
+    size_t budget_mb = 0;
+    unsigned build_sample = 0;
+    obindex2::MergePolicy merge = obindex2::MERGE_POLICY_AND;
+    bool purge = true;
+
+    for(int i = 3; i < argc; i++){
+
+        std::string opt = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if(opt == "--no-purge"){
+            purge = false;
+        }
+        else if(opt == "--merge" && has_value){
+            std::string p = argv[++i];
+            if(p == "none"){
+                merge = obindex2::MERGE_POLICY_NONE;
+            }
+            else if(p == "and"){
+                merge = obindex2::MERGE_POLICY_AND;
+            }
+            else if(p == "or"){
+                merge = obindex2::MERGE_POLICY_OR;
+            }
+            else{
+                usage();
+                return 1;
+            }
+        }
+        else if(opt == "--ratio" && has_value){
+            ratio = atof(argv[++i]);
+        }
+        else if(has_value && (opt == "--window" || opt == "--k" ||
+                              opt == "--s" || opt == "--t" ||
+                              opt == "--checks" || opt == "--rebuild" ||
+                              opt == "--budget-mb" ||
+                              opt == "--build-sample")){
+            unsigned v = strtoul(argv[++i], nullptr, 10);
+            if(opt == "--window"){
+                window = std::max(v, 1u);
+            }
+            else if(opt == "--k"){
+                k = v;
+            }
+            else if(opt == "--s"){
+                s = v;
+            }
+            else if(opt == "--t"){
+                t = v;
+            }
+            else if(opt == "--checks"){
+                checks = v;
+            }
+            else if(opt == "--rebuild"){
+                rebuild_every = v;
+            }
+            else if(opt == "--build-sample"){
+                build_sample = v;
+            }
+            else{
+                budget_mb = v;
+            }
+        }
+        else{
+            usage();
+            return 1;
+        }
+    }
+
+    obindex2::FeatureDumpReader reader(dump_path);
+    if(!reader.good()){
+        std::cerr << "Cannot read the feature dump " << dump_path << std::endl;
+        return 1;
+    }
+
+    obindex2::ImageIndex index(k, s, t, merge, purge);
+    if(budget_mb > 0){
+        index.setMemoryBudget(budget_mb << 20);
+    }
+    index.setBuildSample(build_sample);
+
+    // Reading the dump while the index is updated
+    FrameQueue queue(window);
+    std::thread producer([&reader, &queue]{
+        Frame f;
+        while(reader.next(&f.image_id, &f.kps, &f.descs)){
+            queue.push(&f);
+        }
+        queue.close();
+    });
+
+    auto start = std::chrono::steady_clock::now();
+    unsigned nimages = 0;
+    std::vector<unsigned> dump_ids;     // Dump id of each image of the index
+    Frame f;
+    std::vector<cv::DMatch> matches;
+
+    while(queue.pop(&f)){
+
+        if(f.kps.size() != static_cast<size_t>(f.descs.rows)){
+            std::cerr << "Skipping image " << f.image_id
+                      << ": keypoints and descriptors differ" << std::endl;
+            continue;
+        }
+
+        if(index.numImages() == 0){
+
+            // The first image builds the trees, it needs more than k rows
+            if(f.descs.rows <= static_cast<int>(k)){
+                std::cerr << "Skipping image " << f.image_id
+                          << ": too few descriptors to build the trees"
+                          << std::endl;
+                continue;
+            }
+
+            index.addImage(index.numImages(), f.kps, f.descs);
+        }
+        else{
+
+            // Same matching as a live session: nearest words, ratio test
+            index.searchDescriptorsRatio(f.descs, &matches, ratio,
+                                         std::numeric_limits<double>::max(),
+                                         checks);
+
+            index.addImage(index.numImages(), f.kps, f.descs, matches);
+        }
+
+        dump_ids.push_back(f.image_id);
+        nimages++;
+
+        if(rebuild_every > 0 && nimages % rebuild_every == 0){
+            index.rebuild();
+        }
+
+        if(nimages % 100 == 0){
+            double secs = std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start).count();
+            std::cout << nimages << " images, "
+                      << index.numDescriptors() << " words, "
+                      << index.memoryUsage().total() / (1024.0 * 1024.0) << " MB, "
+                      << nimages / secs << " images/s" << std::endl;
+        }
+    }
+
+    producer.join();
+
+    if(nimages == 0){
+        std::cerr << "No images in " << dump_path << std::endl;
+        return 1;
+    }
+
+    // The snapshot holds the words and postings, the trees are built again,
+    // one per thread, when it is loaded
+    if(!index.save(index_path)){
+        std::cerr << "Cannot write the index " << index_path << std::endl;
+        return 1;
+    }
+
+    std::string ids_path = index_path + ".ids";
+    std::ofstream ids(ids_path.c_str());
+    for(unsigned i = 0; i < dump_ids.size(); i++){
+        ids << dump_ids[i] << "\n";
+    }
+    if(!ids.good()){
+        std::cerr << "Cannot write the image ids " << ids_path << std::endl;
+        return 1;
+    }
+
+    double secs = std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - start).count();
+    std::cout << "Indexed " << nimages << " images, "
+              << index.numDescriptors() << " words in " << secs << " s" << std::endl;
+
+    return 0;
+}
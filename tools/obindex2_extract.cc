@@ -0,0 +1,119 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+#include <boost/filesystem.hpp>
+#include <opencv2/xfeatures2d.hpp>
+
+#include "feature_dump.h"
+
+// Detects and describes the keypoints of every image of a directory, with the
+// same FAST detector and BRIEF descriptor as ex_search, and records them to a
+// feature dump. obindex2_build and obindex2_replay then run on the dump
+// without paying for the image decoding and the feature extraction again.
+
+static void getFilenames(const std::string& directory,
+                         std::vector<std::string>* filenames){
+
+    using namespace boost::filesystem;
+
+    filenames->clear();
+
+    path dir(directory);
+
+    // Retrieving, sorting and filtering filenames.
+    std::vector<path> entries;
+    copy(directory_iterator(dir), directory_iterator(), back_inserter(entries));
+
+    sort(entries.begin(), entries.end());
+
+    for(auto it = entries.begin(); it != entries.end(); it++) {
+        std::string ext = it->extension().c_str();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+        if (ext == ".png" || ext == ".jpg" ||
+            ext == ".ppm" || ext == ".jpeg") {
+            filenames->push_back(it->string());
+        }
+    }
+}
+
+static void usage(){
+    std::cerr << "Usage: obindex2_extract <image_dir> <features.dump> [options]\n"
+              << "  --max-features N  keypoints kept per image (default 1000)\n";
+}
+
+int main(int argc, char** argv){
+
+    if(argc < 3){
+        usage();
+        return 1;
+    }
+
+    std::string image_dir = argv[1];
+    std::string dump_path = argv[2];
+
+    int max_features = 1000;
+
+    for(int i = 3; i < argc; i++){
+
+        std::string opt = argv[i];
+
+        if(opt == "--max-features" && i + 1 < argc){
+            max_features = std::max(atoi(argv[++i]), 1);
+        }
+        else{
+            usage();
+            return 1;
+        }
+    }
+
+    std::vector<std::string> filenames;
+    getFilenames(image_dir, &filenames);
+    if(filenames.empty()){
+        std::cerr << "No images in " << image_dir << std::endl;
+        return 1;
+    }
+
+    cv::Ptr<cv::FastFeatureDetector> det =
+            cv::FastFeatureDetector::create();
+
+    cv::Ptr<cv::xfeatures2d::BriefDescriptorExtractor> des =
+            cv::xfeatures2d::BriefDescriptorExtractor::create();
+
+    obindex2::FeatureDumpWriter writer(dump_path);
+    if(!writer.good()){
+        std::cerr << "Cannot write the feature dump " << dump_path << std::endl;
+        return 1;
+    }
+
+    // Images are numbered in the sorted order of their names
+    for(unsigned i = 0; i < filenames.size(); i++){
+
+        cv::Mat img = cv::imread(filenames[i]);
+        if(img.empty()){
+            std::cerr << "Cannot read " << filenames[i] << std::endl;
+            return 1;
+        }
+
+        std::vector<cv::KeyPoint> kps;
+        cv::Mat dscs;
+        det->detect(img, kps);
+        cv::KeyPointsFilter::retainBest(kps, max_features);
+        des->compute(img, kps, dscs);
+
+        if(!writer.write(i, kps, dscs)){
+            std::cerr << "Cannot write the feature dump " << dump_path << std::endl;
+            return 1;
+        }
+
+        if((i + 1) % 100 == 0){
+            std::cout << i + 1 << " / " << filenames.size() << " images" << std::endl;
+        }
+    }
+
+    std::cout << "Recorded " << filenames.size() << " images to "
+              << dump_path << std::endl;
+
+    return 0;
+}
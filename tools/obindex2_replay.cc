@@ -0,0 +1,319 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include "binary_index.h"
+#include "feature_dump.h"
+#include "profiler.h"
+
+// Replays a feature dump, written by obindex2_extract, through the loop of a
+// live session: searchDescriptors, ratio test, searchImages, addImage and a
+// periodic rebuild. Only the index is timed, so the numbers are reproducible
+// and comparable across changes of the index.
+//
+// The latency of every stage is summarized at the end. With --csv, one line
+// per frame records the latencies, the size of the index and the health of
+// the trees.
+//
+// The index numbers its images from 0 without gaps, so skipped images
+// renumber the rest: the frame column is the id in the index and the
+// image_id column the id in the dump.
+
+enum ReplayStage{
+    STAGE_SEARCH = 0,
+    STAGE_RATIO,
+    STAGE_IMAGES,
+    STAGE_ADD,
+    STAGE_REBUILD,
+    STAGE_FRAME,
+    NUM_STAGES
+};
+
+static const char* kStageNames[NUM_STAGES] = {
+    "searchDescriptors",
+    "ratio test",
+    "searchImages",
+    "addImage",
+    "rebuild",
+    "frame"
+};
+
+static uint64_t elapsedNs(const std::chrono::steady_clock::time_point& start,
+                          const std::chrono::steady_clock::time_point& end){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+static void usage(){
+    std::cerr << "Usage: obindex2_replay <features.dump> [options]\n"
+              << "  --k N           branching factor (default 16)\n"
+              << "  --s N           leaf size (default 150)\n"
+              << "  --t N           number of trees (default 4)\n"
+              << "  --checks N      points checked per search (default 64)\n"
+              << "  --ratio R       ratio test of the matches (default 0.8)\n"
+              << "  --rebuild N     rebuild the trees every N images, 0 never"
+                 " (default 250)\n"
+              << "  --merge P       merge policy: none, and, or (default and)\n"
+              << "  --no-purge      keep the unstable words\n"
+              << "  --fused         search with searchDescriptorsRatio\n"
+              << "  --report N      print the index state every N images"
+                 " (default 100)\n"
+              << "  --csv FILE      write the per-frame measurements to FILE\n";
+}
+
+int main(int argc, char** argv){
+
+    if(argc < 2){
+        usage();
+        return 1;
+    }
+
+    std::string dump_path = argv[1];
+
+    unsigned k = 16;
+    unsigned s = 150;
+    unsigned t = 4;
+    unsigned checks = 64;
+    double ratio = 0.8;
+    unsigned rebuild_every = 250;
+    unsigned report_every = 100;
+    obindex2::MergePolicy merge = obindex2::MERGE_POLICY_AND;
+    bool purge = true;
+    bool fused = false;
+    std::string csv_path;
+
+    for(int i = 2; i < argc; i++){
+
+        std::string opt = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if(opt == "--no-purge"){
+            purge = false;
+        }
+        else if(opt == "--fused"){
+            fused = true;
+        }
+        else if(opt == "--merge" && has_value){
+            std::string p = argv[++i];
+            if(p == "none"){
+                merge = obindex2::MERGE_POLICY_NONE;
+            }
+            else if(p == "and"){
+                merge = obindex2::MERGE_POLICY_AND;
+            }
+            else if(p == "or"){
+                merge = obindex2::MERGE_POLICY_OR;
+            }
+            else{
+                usage();
+                return 1;
+            }
+        }
+        else if(opt == "--ratio" && has_value){
+            ratio = atof(argv[++i]);
+        }
+        else if(opt == "--csv" && has_value){
+            csv_path = argv[++i];
+        }
+        else if(has_value && (opt == "--k" || opt == "--s" || opt == "--t" ||
+                              opt == "--checks" || opt == "--rebuild" ||
+                              opt == "--report")){
+            unsigned v = strtoul(argv[++i], nullptr, 10);
+            if(opt == "--k"){
+                k = v;
+            }
+            else if(opt == "--s"){
+                s = v;
+            }
+            else if(opt == "--t"){
+                t = v;
+            }
+            else if(opt == "--checks"){
+                checks = v;
+            }
+            else if(opt == "--rebuild"){
+                rebuild_every = v;
+            }
+            else{
+                report_every = v;
+            }
+        }
+        else{
+            usage();
+            return 1;
+        }
+    }
+
+    obindex2::FeatureDumpReader reader(dump_path);
+    if(!reader.good()){
+        std::cerr << "Cannot read the feature dump " << dump_path << std::endl;
+        return 1;
+    }
+
+    std::ofstream csv;
+    if(!csv_path.empty()){
+        csv.open(csv_path.c_str());
+        if(!csv.good()){
+            std::cerr << "Cannot write " << csv_path << std::endl;
+            return 1;
+        }
+        csv << "frame,image_id,features,matches,search_us,ratio_us,images_us,"
+               "add_us,rebuild_us,frame_us,words,memory_bytes,nodes,"
+               "degraded_nodes\n";
+    }
+
+    obindex2::ImageIndex index(k, s, t, merge, purge);
+    obindex2::LatencyHistogram hists[NUM_STAGES];
+
+    unsigned nframes = 0;
+    unsigned image_id;
+    std::vector<cv::KeyPoint> kps;
+    cv::Mat descs;
+    std::vector<std::vector<cv::DMatch> > matches_feats;
+    std::vector<cv::DMatch> matches;
+    std::vector<obindex2::ImageMatch> image_matches;
+
+    // The dump is read outside of the timed stages
+    while(reader.next(&image_id, &kps, &descs)){
+
+        if(kps.size() != static_cast<size_t>(descs.rows)){
+            std::cerr << "Skipping image " << image_id
+                      << ": keypoints and descriptors differ" << std::endl;
+            continue;
+        }
+
+        uint64_t ns[NUM_STAGES] = {0};
+        matches.clear();
+
+        if(index.numImages() == 0){
+
+            // The first image builds the trees, it needs more than k rows
+            if(descs.rows <= static_cast<int>(k)){
+                std::cerr << "Skipping image " << image_id
+                          << ": too few descriptors to build the trees"
+                          << std::endl;
+                continue;
+            }
+
+            auto t0 = std::chrono::steady_clock::now();
+            index.addImage(index.numImages(), kps, descs);
+            ns[STAGE_ADD] = elapsedNs(t0, std::chrono::steady_clock::now());
+        }
+        else{
+
+            auto t0 = std::chrono::steady_clock::now();
+            if(fused){
+                index.searchDescriptorsRatio(descs, &matches, ratio,
+                                             std::numeric_limits<double>::max(),
+                                             checks);
+            }
+            else{
+                index.searchDescriptors(descs, &matches_feats, 2, checks);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+
+            if(!fused){
+                for(unsigned m = 0; m < matches_feats.size(); m++){
+                    if(matches_feats[m].size() > 1 &&
+                       matches_feats[m][0].distance <
+                       matches_feats[m][1].distance * ratio){
+                        matches.push_back(matches_feats[m][0]);
+                    }
+                }
+            }
+            auto t2 = std::chrono::steady_clock::now();
+
+            index.searchImages(descs, matches, &image_matches);
+            auto t3 = std::chrono::steady_clock::now();
+
+            index.addImage(index.numImages(), kps, descs, matches);
+            auto t4 = std::chrono::steady_clock::now();
+
+            ns[STAGE_SEARCH] = elapsedNs(t0, t1);
+            ns[STAGE_RATIO] = elapsedNs(t1, t2);
+            ns[STAGE_IMAGES] = elapsedNs(t2, t3);
+            ns[STAGE_ADD] = elapsedNs(t3, t4);
+        }
+
+        nframes++;
+
+        if(rebuild_every > 0 && nframes % rebuild_every == 0){
+            auto t0 = std::chrono::steady_clock::now();
+            index.rebuild();
+            ns[STAGE_REBUILD] = elapsedNs(t0, std::chrono::steady_clock::now());
+            hists[STAGE_REBUILD].record(ns[STAGE_REBUILD]);
+        }
+
+        for(unsigned i = 0; i < STAGE_REBUILD; i++){
+            ns[STAGE_FRAME] += ns[i];
+            if(nframes > 1){
+                hists[i].record(ns[i]);
+            }
+        }
+        ns[STAGE_FRAME] += ns[STAGE_REBUILD];
+        hists[STAGE_FRAME].record(ns[STAGE_FRAME]);
+
+        if(csv.is_open()){
+            csv << nframes - 1 << "," << image_id << ","
+                << descs.rows << "," << matches.size();
+            for(unsigned i = 0; i < NUM_STAGES; i++){
+                csv << "," << ns[i] / 1000.0;
+            }
+            csv << "," << index.numDescriptors()
+                << "," << index.memoryUsage().total()
+                << "," << index.numNodes()
+                << "," << index.numDegradedNodes() << "\n";
+        }
+
+        if(report_every > 0 && nframes % report_every == 0){
+            std::cout << nframes << " images, "
+                      << index.numDescriptors() << " words, "
+                      << index.memoryUsage().total() / (1024.0 * 1024.0) << " MB, "
+                      << index.numNodes() << " nodes, "
+                      << index.numDegradedNodes() << " degraded" << std::endl;
+        }
+    }
+
+    if(nframes == 0){
+        std::cerr << "No images in " << dump_path << std::endl;
+        return 1;
+    }
+
+    // The first frame only builds the trees, it is left out of the stages
+    // but counted in the frame latency
+    std::cout << std::endl
+              << std::left << std::setw(20) << "Stage"
+              << std::right << std::setw(10) << "Count"
+              << std::setw(12) << "mean (us)"
+              << std::setw(12) << "p50 (us)"
+              << std::setw(12) << "p90 (us)"
+              << std::setw(12) << "p99 (us)"
+              << std::setw(12) << "max (us)" << std::endl;
+
+    for(unsigned i = 0; i < NUM_STAGES; i++){
+
+        const obindex2::LatencyHistogram& h = hists[i];
+        if(h.count() == 0){
+            continue;
+        }
+
+        std::cout << std::left << std::setw(20) << kStageNames[i]
+                  << std::right << std::setw(10) << h.count()
+                  << std::fixed << std::setprecision(1)
+                  << std::setw(12) << h.mean() / 1000.0
+                  << std::setw(12) << h.percentile(50) / 1000.0
+                  << std::setw(12) << h.percentile(90) / 1000.0
+                  << std::setw(12) << h.percentile(99) / 1000.0
+                  << std::setw(12) << h.max() / 1000.0 << std::endl;
+    }
+
+    std::cout << std::endl
+              << "Replayed " << nframes << " images: "
+              << index.numDescriptors() << " words, "
+              << index.memoryUsage().total() / (1024.0 * 1024.0) << " MB, "
+              << index.numNodes() << " nodes, "
+              << index.numDegradedNodes() << " degraded" << std::endl;
+
+    return 0;
+}